@@ -13,6 +13,7 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->caches = NULL;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -30,7 +31,18 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 
 int addConstant(Chunk* chunk, Value value) {
     push(value);
+    // Grow the caches first, since a collection the growth triggers marks
+    // the cache of every constant.
+    if (chunk->constants.capacity < chunk->constants.count + 1) {
+        int oldCapacity = chunk->constants.capacity;
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, GROW_CAPACITY(oldCapacity));
+    }
     writeValueArray(&chunk->constants, value);
+    chunk->caches[chunk->constants.count - 1].shape = NULL;
+    chunk->caches[chunk->constants.count - 1].transition = NULL;
+    chunk->caches[chunk->constants.count - 1].slot = 0;
+    chunk->caches[chunk->constants.count - 1].methodCount = 0;
+    chunk->caches[chunk->constants.count - 1].methods = NULL;
     pop();
     return chunk->constants.count - 1;
 }
@@ -38,6 +50,10 @@ int addConstant(Chunk* chunk, Value value) {
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        FREE_ARRAY(MethodCacheEntry, chunk->caches[i].methods, METHOD_CACHE_SIZE);
+    }
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->constants.capacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
\ No newline at end of file
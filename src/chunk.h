@@ -25,6 +25,7 @@ typedef enum {
     OP_SET_PROPERTY,
     OP_GET_SUPER,
     OP_BUILD_LIST,
+    OP_BUILD_MAP,
     OP_INDEX_SUBSCR,
     OP_STORE_SUBSCR,
     OP_EQUAL,
@@ -49,6 +50,7 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
     OP_CLOSURE,
@@ -59,15 +61,56 @@ typedef enum {
     OP_METHOD,
     OP_DUP,
     OP_DOUBLE_DUP,
+    // Specialized forms the VM rewrites generic instructions into once it has
+    // seen their operand types. The compiler never emits them.
+    OP_ADD_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
+    // Superinstructions the compiler fuses hot sequences into. Only the first
+    // opcode of the sequence is replaced, so the fused instruction spans the
+    // same bytes and the original instructions after it stay intact.
+    OP_GET_LOCAL_LOCAL,
+    OP_GET_LOCAL_CONSTANT_ADD,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_GET_THIS_PROPERTY,
     OP_END,
 } OpCode;
 
+#define METHOD_CACHE_SIZE 4
+
+// A receiver an invoke site has seen and the method it resolved to. The
+// receiver is the instance's shape, or the superclass for super calls. The
+// entry is only trusted while epoch matches the methodEpoch of the class
+// the method was found in.
+typedef struct {
+    Obj* receiver;
+    Value method;
+    int epoch;
+} MethodCacheEntry;
+
+// Remembers the shape a property access site last saw and the slot its
+// field lives in. When the site added the field, transition is the shape the
+// instance moved to. Every site gets its own name constant, so caches are
+// kept parallel to the constant pool and indexed by the site's name constant.
+//
+// Invoke sites instead fill methods, allocated on their first miss, with up
+// to METHOD_CACHE_SIZE receivers.
+typedef struct {
+    ObjShape* shape;
+    ObjShape* transition;
+    int slot;
+
+    int methodCount;
+    MethodCacheEntry* methods;
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t * code;
     int* lines;
     ValueArray constants;
+    InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -17,6 +17,9 @@
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
 
+#define DEBUG_CACHE_STATS
+#define DEBUG_OPCODE_NGRAMS
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif //QI_COMMON_H
@@ -24,4 +27,6 @@
 #undef DEBUG_PRINT_CODE
 #undef DEBUG_TRACE_EXECUTION
 #undef DEBUG_STRESS_GC
-#undef DEBUG_LOG_GC
\ No newline at end of file
+#undef DEBUG_LOG_GC
+#undef DEBUG_CACHE_STATS
+#undef DEBUG_OPCODE_NGRAMS
\ No newline at end of file
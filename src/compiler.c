@@ -10,6 +10,7 @@
 #include "compiler.h"
 #include "memory.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -75,6 +76,12 @@ typedef struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    // Offset of the last OP_GET_GLOBAL, so ++ and -- can tell it apart from
+    // bytes of a slot operand.
+    int lastGlobalGet;
+    // Where the last OP_CALL ends, so a return can tell the call is the last
+    // thing its expression does.
+    int lastCallEnd;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -187,6 +194,7 @@ static void emitReturn() {
 
 static uint8_t makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
+    writeBarrier(&current->function->obj, value);
     if (constant > UINT8_MAX) {
         error(L"太多常量在一个块中里面。");
         return 0;
@@ -217,11 +225,14 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastGlobalGet = -1;
+    compiler->lastCallEnd = -1;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start,
                                              parser.previous.length);
+        writeBarrier(&current->function->obj, OBJ_VAL(current->function->name));
     }
 
     Local* local = &current->locals[current->localCount++];
@@ -236,14 +247,61 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     }
 }
 
+static int getByteCountForArguments(int ip);
+
+// Rewrites hot instruction sequences into superinstructions once the whole
+// function has been emitted. Jump offsets stay valid because a fused
+// instruction covers exactly the bytes of the sequence it replaces, and a
+// jump into the middle of one still runs the original instructions.
+static void fuseInstructions() {
+    Chunk* chunk = currentChunk();
+    uint8_t* code = chunk->code;
+    bool isMethod = current->type == TYPE_METHOD || current->type == TYPE_INITIALIZER;
+
+    int i = 0;
+    while (i < chunk->count) {
+        int next = i + 1 + getByteCountForArguments(i);
+        if (next >= chunk->count) break;
+
+        switch (code[i]) {
+            case OP_GET_LOCAL:
+                if (code[next] == OP_GET_LOCAL) {
+                    code[i] = OP_GET_LOCAL_LOCAL;
+                    next += 2;
+                } else if (code[next] == OP_CONSTANT && next + 2 < chunk->count &&
+                           code[next + 2] == OP_ADD) {
+                    code[i] = OP_GET_LOCAL_CONSTANT_ADD;
+                    next += 3;
+                } else if (isMethod && code[i + 1] == 0 && code[next] == OP_GET_PROPERTY) {
+                    code[i] = OP_GET_THIS_PROPERTY;
+                    next += 2;
+                }
+                break;
+            case OP_LESS:
+                if (code[next] == OP_JUMP_IF_FALSE && next + 3 < chunk->count &&
+                    code[next + 3] == OP_POP) {
+                    code[i] = OP_LESS_JUMP_IF_FALSE;
+                    next += 4;
+                }
+                break;
+            default:
+                break;
+        }
+
+        i = next;
+    }
+}
+
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    if (!parser.hadError) fuseInstructions();
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL
-            ? function->name->chars : L"《脚本》");
+        wchar_t* name = function->name != NULL ? wideString(function->name) : NULL;
+        disassembleChunk(currentChunk(), name != NULL ? name : L"《脚本》");
+        if (name != NULL) freeWideString(function->name, name);
     }
 #endif
 
@@ -280,6 +338,27 @@ static uint8_t identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static int globalVariable(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error(L"太多全局变量。");
+        return 0;
+    }
+
+    return slot;
+}
+
+static void emitVariable(uint8_t op, int arg) {
+    if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL) {
+        if (op == OP_GET_GLOBAL) current->lastGlobalGet = currentChunk()->count;
+        emitByte(op);
+        emitByte((arg >> 8) & 0xff);
+        emitByte(arg & 0xff);
+    } else {
+        emitBytes(op, (uint8_t)arg);
+    }
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
     if (a->length != b->length) return false;
     return memcmp(a->start, b->start, a->length * sizeof(wchar_t)) == 0;
@@ -366,13 +445,13 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const wchar_t* errorMessage) {
+static int parseVariable(const wchar_t* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -380,13 +459,13 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitVariable(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -450,7 +529,12 @@ static void postfix(bool canAssign) {
                 op1 = currentChunk()->code[currentChunk()->count - 2];
                 op2 = currentChunk()->code[currentChunk()->count - 1];
             }
-            if (op1 == OP_GET_PROPERTY) {
+            if (current->lastGlobalGet == currentChunk()->count - 3) {
+                emitByte(operatorType == TOKEN_PLUS_PLUS ? OP_INCREMENT : OP_DECREMENT);
+                emitVariable(OP_SET_GLOBAL, (op1 << 8) | op2);
+                emitByte(operatorType == TOKEN_PLUS_PLUS ? OP_DECREMENT : OP_INCREMENT);
+                break;
+            } else if (op1 == OP_GET_PROPERTY) {
                 emitByte(op2);
                 currentChunk()->code[currentChunk()->count - 2] = OP_GET_PROPERTY;
                 currentChunk()->code[currentChunk()->count - 3] = OP_DUP;
@@ -458,10 +542,9 @@ static void postfix(bool canAssign) {
                 emitBytes(OP_SET_PROPERTY, op2);
                 emitByte(operatorType == TOKEN_PLUS_PLUS ? OP_DECREMENT : OP_INCREMENT);
                 break;
-            } else if (op1 == OP_GET_GLOBAL || op1 == OP_GET_LOCAL || op1 == OP_GET_UPVALUE) {
+            } else if (op1 == OP_GET_LOCAL || op1 == OP_GET_UPVALUE) {
                 emitByte(operatorType == TOKEN_PLUS_PLUS ? OP_INCREMENT : OP_DECREMENT);
-                emitBytes(op1 == OP_GET_GLOBAL ? OP_SET_GLOBAL
-                                               : op1 == OP_GET_LOCAL ? OP_SET_LOCAL : OP_SET_UPVALUE, op2);
+                emitBytes(op1 == OP_GET_LOCAL ? OP_SET_LOCAL : OP_SET_UPVALUE, op2);
                 emitByte(operatorType == TOKEN_PLUS_PLUS ? OP_DECREMENT : OP_INCREMENT);
                 break;
             } else if (op2 == OP_INDEX_SUBSCR) {
@@ -482,6 +565,7 @@ static void postfix(bool canAssign) {
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
     emitBytes(OP_CALL, argCount);
+    current->lastCallEnd = currentChunk()->count;
 }
 
 static void dot(bool canAssign) {
@@ -562,13 +646,16 @@ static void or_(bool canAssign) {
 }
 
 static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(handleEscapeSequences(copyString(parser.previous.start + 1,
-                                    parser.previous.length - 2))));
+    emitConstant(OBJ_VAL(handleEscapeSequences(parser.previous.start + 1,
+                                               parser.previous.length - 2)));
 }
 
+// Compiles a list, or a map if the first item is followed by a colon, as
+// in 【键：值，…】. 【：】 is the empty map.
 static void list(bool canAssign) {
+    bool isMap = match(TOKEN_COLON);
     int itemCount = 0;
-    if (!check(TOKEN_RIGHT_BRACKET)) {
+    if (!isMap && !check(TOKEN_RIGHT_BRACKET)) {
         do {
             if (check(TOKEN_RIGHT_BRACKET)) {
                 // Trailing comma case
@@ -577,16 +664,24 @@ static void list(bool canAssign) {
 
             parsePrecedence(PREC_OR);
 
+            if (itemCount == 0 && match(TOKEN_COLON)) {
+                isMap = true;
+                parsePrecedence(PREC_OR);
+            } else if (isMap) {
+                consume(TOKEN_COLON, L"在映射键后期待「 ：」。");
+                parsePrecedence(PREC_OR);
+            }
+
             if (itemCount == UINT8_COUNT) {
-                error(L"列表中的项目不能超过256个。");
+                error(isMap ? L"映射中的项目不能超过256个。" : L"列表中的项目不能超过256个。");
             }
             itemCount++;
         } while (match(TOKEN_COMMA));
     }
 
-    consume(TOKEN_RIGHT_BRACKET, L"在列表后期待「 】」。");
+    consume(TOKEN_RIGHT_BRACKET, isMap ? L"在映射后期待「 】」。" : L"在列表后期待「 】」。");
 
-    emitByte(OP_BUILD_LIST);
+    emitByte(isMap ? OP_BUILD_MAP : OP_BUILD_LIST);
     emitByte(itemCount);
 }
 
@@ -619,22 +714,22 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t) arg);
+        emitVariable(setOp, arg);
     } else if (canAssign && (match(TOKEN_PLUS_EQUAL) || match(TOKEN_MINUS_EQUAL))) {
         TokenType type = parser.previous.type;
-        emitBytes(getOp, (uint8_t) arg);
+        emitVariable(getOp, arg);
         expression();
         emitByte(type == TOKEN_PLUS_EQUAL ? OP_ADD : OP_SUBTRACT);
-        emitBytes(setOp, (uint8_t) arg);
+        emitVariable(setOp, arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitVariable(getOp, arg);
     }
 }
 
@@ -699,17 +794,20 @@ static void unary(bool canAssign) {
                 op1 = currentChunk()->code[currentChunk()->count - 2];
                 op2 = currentChunk()->code[currentChunk()->count - 1];
             }
-            if (op1 == OP_GET_PROPERTY) {
+            if (current->lastGlobalGet == currentChunk()->count - 3) {
+                emitByte(operatorType == TOKEN_PLUS_PLUS ? OP_INCREMENT : OP_DECREMENT);
+                emitVariable(OP_SET_GLOBAL, (op1 << 8) | op2);
+                break;
+            } else if (op1 == OP_GET_PROPERTY) {
                 emitByte(op2);
                 currentChunk()->code[currentChunk()->count - 2] = OP_GET_PROPERTY;
                 currentChunk()->code[currentChunk()->count - 3] = OP_DUP;
                 emitByte(operatorType == TOKEN_PLUS_PLUS ? OP_INCREMENT : OP_DECREMENT);
                 emitBytes(OP_SET_PROPERTY, op2);
                 break;
-            } else if (op1 == OP_GET_GLOBAL || op1 == OP_GET_LOCAL || op1 == OP_GET_UPVALUE) {
+            } else if (op1 == OP_GET_LOCAL || op1 == OP_GET_UPVALUE) {
                 emitByte(operatorType == TOKEN_PLUS_PLUS ? OP_INCREMENT : OP_DECREMENT);
-                emitBytes(op1 == OP_GET_GLOBAL ? OP_SET_GLOBAL
-                                               : op1 == OP_GET_LOCAL ? OP_SET_LOCAL : OP_SET_UPVALUE, op2);
+                emitBytes(op1 == OP_GET_LOCAL ? OP_SET_LOCAL : OP_SET_UPVALUE, op2);
                 break;
             } else if (op2 == OP_INDEX_SUBSCR) {
                 emitByte(op2);
@@ -831,13 +929,13 @@ static int getByteCountForArguments(int ip) {
         case OP_RETURN:
         case OP_INHERIT:
         case OP_DUP:
+        case OP_ADD_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
         case OP_END:
             return 0;
 
         case OP_CONSTANT:
-        case OP_GET_GLOBAL:
-        case OP_DEFINE_GLOBAL:
-        case OP_SET_GLOBAL:
         case OP_GET_PROPERTY:
         case OP_SET_PROPERTY:
         case OP_GET_SUPER:
@@ -848,8 +946,14 @@ static int getByteCountForArguments(int ip) {
         case OP_GET_UPVALUE:
         case OP_SET_UPVALUE:
         case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
             return 1;
 
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
         case OP_INVOKE:
         case OP_SUPER_INVOKE:
         case OP_JUMP_IF_FALSE:
@@ -857,8 +961,19 @@ static int getByteCountForArguments(int ip) {
         case OP_LOOP:
             return 2;
 
-        case OP_CLOSURE:
-            return 2 + (current->function->upvalueCount);
+        case OP_GET_LOCAL_LOCAL:
+        case OP_GET_THIS_PROPERTY:
+            return 3;
+
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_LESS_JUMP_IF_FALSE:
+            return 4;
+
+        case OP_CLOSURE: {
+            Chunk* chunk = &current->function->chunk;
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[ip + 1]]);
+            return 1 + 2 * function->upvalueCount;
+        }
 
         default:
             // Unreachable.
@@ -890,7 +1005,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent(L"参数不能超过255个。");
             }
-            uint8_t constant = parseVariable(L"期待参数名。");
+            int constant = parseVariable(L"期待参数名。");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -928,7 +1043,7 @@ static void classDeclaration() {
     declareVariable();
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -968,14 +1083,14 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable(L"期待功能名。");
+    int global = parseVariable(L"期待功能名。");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    uint8_t global = parseVariable(L"期待变量名。");
+    int global = parseVariable(L"期待变量名。");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -1095,6 +1210,11 @@ static void returnStatement() {
         expression();
         match(TOKEN_SEMICOLON);
 
+        // The OP_RETURN stays after it for jumps that land past the call and
+        // for callees that don't take over the frame.
+        if (current->lastCallEnd == currentChunk()->count) {
+            currentChunk()->code[currentChunk()->count - 2] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
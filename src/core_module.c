@@ -32,11 +32,15 @@ wchar_t* getType(Value value) {
             case OBJ_NATIVE: return L"静态方法";
             case OBJ_INSTANCE: return L"实例";
             case OBJ_FUNCTION: return L"功能";
-            case OBJ_STRING: return L"字符串";
+            case OBJ_STRING:
+            case OBJ_CONCAT: return L"字符串";
+            case OBJ_BUILDER: return L"构建器";
             case OBJ_LIST: return L"列表";
+            case OBJ_MAP: return L"映射";
             case OBJ_UPVALUE: return L"升值";
             case OBJ_CLOSURE: return L"关闭";
             case OBJ_CLASS: return L"类";
+            case OBJ_SHAPE: return L"形状";
         }
     }
     // Unreachable.
@@ -60,9 +64,11 @@ bool scanNative(int argCount, Value* args) {
     char input[100];
     while (fgets(input, 100, stdin) == NULL) {}
     input[ strlen(input)-1] = '\0';
-    wchar_t* winput = ALLOCATE(wchar_t, strlen(input));
-    mbstowcs(winput, input, strlen(input));
+    size_t length = strlen(input);
+    wchar_t* winput = ALLOCATE(wchar_t, length + 1);
+    mbstowcs(winput, input, length + 1);
     args[-1] = OBJ_VAL(copyString(winput, wcslen(winput)));
+    FREE_ARRAY(wchar_t, winput, length + 1);
     return true;
 }
 
@@ -71,6 +77,51 @@ bool clockNative(int argCount, Value* args) {
     return true;
 }
 
+bool gcBudgetNative(int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        return nativeError(args,
+                           L"参数 1（微秒）的类型必须是「数字」，而不是「%ls」。", getType(args[0]));
+    }
+    if (AS_NUMBER(args[0]) < 0) return nativeError(args, L"参数 1（微秒）不能是负数。");
+    vm.gcPauseBudget = (uint64_t)(AS_NUMBER(args[0]) * 1000);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+bool maxPauseNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL(vm.gcMaxPause / 1e6);
+    return true;
+}
+
+bool markThreadsNative(int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        return nativeError(args,
+                           L"参数 1（线程）的类型必须是「数字」，而不是「%ls」。", getType(args[0]));
+    }
+    double threads = AS_NUMBER(args[0]);
+    if (threads < 1 || threads > MAX_MARK_THREADS) {
+        return nativeError(args, L"参数 1（线程）必须在 1 到 %d 之间。", MAX_MARK_THREADS);
+    }
+    vm.markThreads = (int)threads;
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+bool eagerSweepsNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)vm.eagerSweeps);
+    return true;
+}
+
+bool lazySweepsNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)vm.lazySweeps);
+    return true;
+}
+
+bool probeLengthNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL(tableProbeLength(&vm.strings));
+    return true;
+}
+
 bool typeofNative(int argCount, Value* args) {
     wchar_t* type = getType(args[0]);
     args[-1] = OBJ_VAL(copyString(type, wcslen(type)));
@@ -281,23 +332,44 @@ bool stonNative(int argCount, Value* args) {
         return nativeError(args,
                            L"参数 1（输入）的类型必须是「字符串」，而不是「%ls」。", getType(args[0]));
     }
-    args[-1] = NUMBER_VAL(wcstod(AS_WCSTRING(args[0]), NULL));
+    ObjString* string = flattenString(args[0]);
+    wchar_t* chars = wideString(string);
+    double number = wcstod(chars, NULL);
+    freeWideString(string, chars);
+    args[-1] = NUMBER_VAL(number);
     return true;
 }
 
+// Leaves the class and its name on the stack, so they survive collections
+// while natives are added, until the caller pops both.
+static ObjClass* newCoreClass(const wchar_t* name) {
+    push(OBJ_VAL(copyString(name, (int)wcslen(name))));
+    ObjClass* klass = newClass(AS_STRING(vm.stackTop[-1]));
+    push(OBJ_VAL(klass));
+    return klass;
+}
+
 void initCoreClass() {
     // System Core Class
-    ObjClass* systemClass = newClass(copyString(L"系统", 2));
+    ObjClass* systemClass = newCoreClass(L"系统");
     defineNative(L"打印", printNative, 1, systemClass);
     defineNative(L"打印行", printlnNative, 1, systemClass);
     defineNative(L"扫描", scanNative, 0, systemClass);
     defineNative(L"时钟", clockNative, 0, systemClass);
     defineNative(L"型", typeofNative, 1, systemClass);
+    defineNative(L"回收预算", gcBudgetNative, 1, systemClass);
+    defineNative(L"最大暂停", maxPauseNative, 0, systemClass);
+    defineNative(L"标记线程", markThreadsNative, 1, systemClass);
+    defineNative(L"及早清扫", eagerSweepsNative, 0, systemClass);
+    defineNative(L"惰性清扫", lazySweepsNative, 0, systemClass);
+    defineNative(L"探测长度", probeLengthNative, 0, systemClass);
     ObjInstance* systemInstance = newInstance(systemClass, true);
     defineNativeInstance(L"系统", systemInstance);
+    pop();
+    pop();
 
     // Number Core Class
-    ObjClass* numberClass = newClass(copyString(L"数字", 2));
+    ObjClass* numberClass = newCoreClass(L"数字");
     defineNative(L"平方根", sqrtNative, 1, numberClass);
     defineNative(L"次方", powNative, 2, numberClass);
     defineNative(L"最小", minNative, 2, numberClass);
@@ -324,10 +396,14 @@ void initCoreClass() {
     defineProperty(L"最大安全", NUMBER_VAL(9007199254740991), numberInstance);
     defineProperty(L"最小安全", NUMBER_VAL(-9007199254740991), numberInstance);
     defineNativeInstance(L"数字", numberInstance);
+    pop();
+    pop();
 
     // String Core Class
-    ObjClass* stringClass = newClass(copyString(L"字符串", 3));
+    ObjClass* stringClass = newCoreClass(L"字符串");
     defineNative(L"串到数", stonNative, 1, stringClass);
     ObjInstance* stringInstance = newInstance(stringClass, true);
     defineNativeInstance(L"字符串", stringInstance);
+    pop();
+    pop();
 }
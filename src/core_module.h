@@ -23,6 +23,12 @@ bool roundNative(int argCount, Value* args);
 bool stonNative(int argCount, Value* args);
 bool ntosNative(int argCount, Value* args);
 bool typeofNative(int argCount, Value* args);
+bool gcBudgetNative(int argCount, Value* args);
+bool maxPauseNative(int argCount, Value* args);
+bool markThreadsNative(int argCount, Value* args);
+bool eagerSweepsNative(int argCount, Value* args);
+bool lazySweepsNative(int argCount, Value* args);
+bool probeLengthNative(int argCount, Value* args);
 void initCoreClass();
 
 #endif //QI_CORE_MODULE_H
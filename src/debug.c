@@ -3,10 +3,12 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const wchar_t* name) {
     wprintf(L"== %ls == \n", name);
@@ -24,6 +26,15 @@ static int constantInstruction(const wchar_t* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int globalInstruction(const wchar_t* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    wprintf(L"%-16ls %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    wprintf(L"'\n");
+    return offset + 3;
+}
+
 static int invokeInstruction(const wchar_t* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
@@ -33,6 +44,15 @@ static int invokeInstruction(const wchar_t* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+static int localConstantInstruction(const wchar_t* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 3];
+    wprintf(L"%-16ls %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    wprintf(L"'\n");
+    return offset + 5;
+}
+
 static int simpleInstruction(const wchar_t* name, int offset) {
     wprintf(L"%ls\n", name);
     return offset + 1;
@@ -72,15 +92,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_POP:
             return simpleInstruction(L"OP_POP", offset);
         case OP_GET_GLOBAL:
-            return constantInstruction(L"OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction(L"OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction(L"OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction(L"OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction(L"OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction(L"OP_SET_LOCAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction(L"OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction(L"OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction(L"OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
@@ -93,6 +113,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction(L"OP_GET_SUPER", chunk, offset);
         case OP_BUILD_LIST:
             return byteInstruction(L"OP_BUILD_LIST", chunk, offset);
+        case OP_BUILD_MAP:
+            return byteInstruction(L"OP_BUILD_MAP", chunk, offset);
         case OP_INDEX_SUBSCR:
             return simpleInstruction(L"OP_INDEX_SUBSCR", offset);
         case OP_STORE_SUBSCR:
@@ -127,6 +149,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction(L"OP_DUP", offset);
         case OP_DOUBLE_DUP:
             return simpleInstruction(L"OP_DOUBLE_DUP", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction(L"OP_ADD_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction(L"OP_LESS_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction(L"OP_GREATER_NUM", offset);
+        case OP_GET_LOCAL_LOCAL:
+            wprintf(L"%-16ls %4d %4d\n", L"OP_GET_LOCAL_LOCAL", chunk->code[offset + 1], chunk->code[offset + 3]);
+            return offset + 4;
+        case OP_GET_LOCAL_CONSTANT_ADD:
+            return localConstantInstruction(L"OP_GET_LOCAL_CONSTANT_ADD", chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            jumpInstruction(L"OP_LESS_JUMP_IF_FALSE", 1, chunk, offset + 1);
+            return offset + 5;
+        case OP_GET_THIS_PROPERTY:
+            return constantInstruction(L"OP_GET_THIS_PROPERTY", chunk, offset + 2) + 1;
         case OP_JUMP:
             return jumpInstruction(L"OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
@@ -135,6 +173,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction(L"OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction(L"OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction(L"OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction(L"OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
@@ -142,7 +182,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
-            wprintf(L"%-16s %4d ", L"OP_CLOSURE", constant);
+            wprintf(L"%-16ls %4d ", L"OP_CLOSURE", constant);
             printValue(chunk->constants.values[constant]);
             wprintf(L"\n");
 
@@ -168,4 +208,105 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             wprintf(L"Unknown opcode %d\n", instruction);
             return offset + 1;
     }
-}
\ No newline at end of file
+}
+#ifdef DEBUG_OPCODE_NGRAMS
+#define OPCODE_COUNT (OP_END + 1)
+#define NGRAMS_SHOWN 20
+
+static const wchar_t* opcodeNames[OPCODE_COUNT] = {
+    [OP_CONSTANT] = L"CONSTANT", [OP_NIL] = L"NIL", [OP_TRUE] = L"TRUE",
+    [OP_FALSE] = L"FALSE", [OP_POP] = L"POP", [OP_GET_LOCAL] = L"GET_LOCAL",
+    [OP_SET_LOCAL] = L"SET_LOCAL", [OP_GET_GLOBAL] = L"GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = L"DEFINE_GLOBAL", [OP_SET_GLOBAL] = L"SET_GLOBAL",
+    [OP_GET_UPVALUE] = L"GET_UPVALUE", [OP_SET_UPVALUE] = L"SET_UPVALUE",
+    [OP_GET_PROPERTY] = L"GET_PROPERTY", [OP_SET_PROPERTY] = L"SET_PROPERTY",
+    [OP_GET_SUPER] = L"GET_SUPER", [OP_BUILD_LIST] = L"BUILD_LIST",
+    [OP_BUILD_MAP] = L"BUILD_MAP",
+    [OP_INDEX_SUBSCR] = L"INDEX_SUBSCR", [OP_STORE_SUBSCR] = L"STORE_SUBSCR",
+    [OP_EQUAL] = L"EQUAL", [OP_GREATER] = L"GREATER", [OP_LESS] = L"LESS",
+    [OP_ADD] = L"ADD", [OP_SUBTRACT] = L"SUBTRACT", [OP_BITWISE_NOT] = L"BITWISE_NOT",
+    [OP_BITWISE_OR] = L"BITWISE_OR", [OP_BITWISE_XOR] = L"BITWISE_XOR",
+    [OP_BITWISE_AND] = L"BITWISE_AND", [OP_BITWISE_LEFT_SHIFT] = L"BITWISE_LEFT_SHIFT",
+    [OP_BITWISE_RIGHT_SHIFT] = L"BITWISE_RIGHT_SHIFT", [OP_INCREMENT] = L"INCREMENT",
+    [OP_DECREMENT] = L"DECREMENT", [OP_MULTIPLY] = L"MULTIPLY", [OP_DIVIDE] = L"DIVIDE",
+    [OP_MODULO] = L"MODULO", [OP_NOT] = L"NOT", [OP_NEGATE] = L"NEGATE",
+    [OP_JUMP] = L"JUMP", [OP_JUMP_IF_FALSE] = L"JUMP_IF_FALSE", [OP_LOOP] = L"LOOP",
+    [OP_CALL] = L"CALL", [OP_TAIL_CALL] = L"TAIL_CALL", [OP_INVOKE] = L"INVOKE",
+    [OP_SUPER_INVOKE] = L"SUPER_INVOKE",
+    [OP_CLOSURE] = L"CLOSURE", [OP_CLOSE_UPVALUE] = L"CLOSE_UPVALUE",
+    [OP_RETURN] = L"RETURN", [OP_CLASS] = L"CLASS", [OP_INHERIT] = L"INHERIT",
+    [OP_METHOD] = L"METHOD", [OP_DUP] = L"DUP", [OP_DOUBLE_DUP] = L"DOUBLE_DUP",
+    [OP_ADD_NUM] = L"ADD_NUM", [OP_LESS_NUM] = L"LESS_NUM",
+    [OP_GREATER_NUM] = L"GREATER_NUM", [OP_GET_LOCAL_LOCAL] = L"GET_LOCAL_LOCAL",
+    [OP_GET_LOCAL_CONSTANT_ADD] = L"GET_LOCAL_CONSTANT_ADD",
+    [OP_LESS_JUMP_IF_FALSE] = L"LESS_JUMP_IF_FALSE",
+    [OP_GET_THIS_PROPERTY] = L"GET_THIS_PROPERTY", [OP_END] = L"END",
+};
+
+// Counts of every executed sequence of three opcodes. Pairs are summed from
+// these when the report is printed.
+static size_t trigrams[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static size_t bigrams[OPCODE_COUNT][OPCODE_COUNT];
+static uint8_t previous[2] = {OP_END, OP_END};
+
+void recordOpcode(uint8_t opcode) {
+    trigrams[previous[0]][previous[1]][opcode]++;
+    previous[0] = previous[1];
+    previous[1] = opcode;
+}
+
+typedef struct {
+    size_t count;
+    int index;
+} NgramCount;
+
+static int compareNgrams(const void* a, const void* b) {
+    size_t countA = ((const NgramCount*)a)->count;
+    size_t countB = ((const NgramCount*)b)->count;
+    return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+static void printTop(size_t* counts, int total, int n) {
+    NgramCount* sorted = malloc(sizeof(NgramCount) * total);
+    for (int i = 0; i < total; i++) {
+        sorted[i].count = counts[i];
+        sorted[i].index = i;
+    }
+    qsort(sorted, total, sizeof(NgramCount), compareNgrams);
+
+    for (int i = 0; i < NGRAMS_SHOWN && i < total && sorted[i].count > 0; i++) {
+        fwprintf(stderr, L"%12zu ", sorted[i].count);
+        int index = sorted[i].index;
+        for (int j = n - 1; j >= 0; j--) {
+            int opcode = index;
+            for (int k = 0; k < j; k++) opcode /= OPCODE_COUNT;
+            fwprintf(stderr, L" %ls", opcodeNames[opcode % OPCODE_COUNT]);
+        }
+        fwprintf(stderr, L"\n");
+    }
+    free(sorted);
+}
+
+void printOpcodeNgrams() {
+    for (int a = 0; a < OPCODE_COUNT; a++) {
+        for (int b = 0; b < OPCODE_COUNT; b++) {
+            bigrams[a][b] = 0;
+        }
+    }
+    for (int a = 0; a < OPCODE_COUNT; a++) {
+        for (int b = 0; b < OPCODE_COUNT; b++) {
+            for (int c = 0; c < OPCODE_COUNT; c++) {
+                bigrams[b][c] += trigrams[a][b][c];
+            }
+        }
+    }
+
+    fwprintf(stderr, L"-- opcode pairs:\n");
+    printTop(&bigrams[0][0], OPCODE_COUNT * OPCODE_COUNT, 2);
+    fwprintf(stderr, L"-- opcode triples:\n");
+    printTop(&trigrams[0][0][0], OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT, 3);
+}
+
+#undef OPCODE_COUNT
+#undef NGRAMS_SHOWN
+#endif
@@ -10,4 +10,9 @@
 void disassembleChunk(Chunk* chunk, const wchar_t* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+#ifdef DEBUG_OPCODE_NGRAMS
+void recordOpcode(uint8_t opcode);
+void printOpcodeNgrams();
+#endif
+
 #endif //QI_DEBUG_H
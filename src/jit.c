@@ -0,0 +1,1012 @@
+//
+// Baseline x86-64 compiler for hot functions.
+//
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "memory.h"
+
+// Each instruction is translated on its own into machine code that works on
+// the same stack and frames as the interpreter. Locals, globals, upvalues,
+// constants, jumps and number arithmetic are emitted inline; everything else
+// calls jitExecute(), so the two can never disagree about semantics.
+//
+// The generated code keeps the interpreter's state in callee-saved registers:
+//   rbx  frame->slots
+//   rbp  QNAN, for number checks
+//   r12  &vm.stackTop
+//   r13  the stack top, written back to vm.stackTop around helper calls
+//   r14  the CallFrame
+//   r15  &vm.globalValues.values
+// The stacks can move during any call out of the generated code, so rbx and
+// r14 are reloaded after each one.
+
+typedef enum {
+    RAX,
+    RCX,
+    RDX,
+} Register;
+
+#define JMP 0xE9
+#define JAE 0x83
+#define JE  0x84
+#define JNE 0x85
+#define JS  0x88
+#define JGE 0x8D
+#define JLE 0x8E
+
+typedef struct {
+    int at;     // Where the rel32 operand is.
+    int target; // Bytecode offset it jumps to.
+} Jump;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+
+    Jump* jumps;
+    int jumpCount;
+    int jumpCapacity;
+
+    int* offsets;
+    int errorExit;
+    int exit;
+    int equalValues;
+    // Where the first instruction starts. The prologue is the same for every
+    // function, so this is also where calls enter other compiled functions.
+    int body;
+} JitCompiler;
+
+static void emitByte(JitCompiler* compiler, uint8_t byte) {
+    if (compiler->capacity < compiler->count + 1) {
+        compiler->capacity = GROW_CAPACITY(compiler->capacity);
+        compiler->code = realloc(compiler->code, compiler->capacity);
+        if (compiler->code == NULL) exit(1);
+    }
+    compiler->code[compiler->count++] = byte;
+}
+
+static void emitBytes(JitCompiler* compiler, int count, ...) {
+    va_list args;
+    va_start(args, count);
+    for (int i = 0; i < count; i++) {
+        emitByte(compiler, (uint8_t)va_arg(args, int));
+    }
+    va_end(args);
+}
+
+static void emit32(JitCompiler* compiler, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emitByte(compiler, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void emit64(JitCompiler* compiler, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emitByte(compiler, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+// Emits a jmp or jcc with its rel32 left to be patched and returns where
+// the rel32 is.
+static int emitJump(JitCompiler* compiler, uint8_t condition) {
+    if (condition == JMP) {
+        emitByte(compiler, JMP);
+    } else {
+        emitBytes(compiler, 2, 0x0F, condition);
+    }
+    emit32(compiler, 0);
+    return compiler->count - 4;
+}
+
+static void patchJump(JitCompiler* compiler, int at, int target) {
+    int32_t offset = target - (at + 4);
+    memcpy(compiler->code + at, &offset, sizeof(offset));
+}
+
+static void patchHere(JitCompiler* compiler, int at) {
+    patchJump(compiler, at, compiler->count);
+}
+
+static void emitJumpTo(JitCompiler* compiler, uint8_t condition, int target) {
+    patchJump(compiler, emitJump(compiler, condition), target);
+}
+
+// Jumps to another instruction, which may not have been compiled yet.
+static void emitBytecodeJump(JitCompiler* compiler, uint8_t condition, int target) {
+    if (compiler->jumpCapacity < compiler->jumpCount + 1) {
+        compiler->jumpCapacity = GROW_CAPACITY(compiler->jumpCapacity);
+        compiler->jumps = realloc(compiler->jumps, sizeof(Jump) * compiler->jumpCapacity);
+        if (compiler->jumps == NULL) exit(1);
+    }
+    Jump* jump = &compiler->jumps[compiler->jumpCount++];
+    jump->at = emitJump(compiler, condition);
+    jump->target = target;
+}
+
+// mov reg, imm64
+static void emitLoadImmediate(JitCompiler* compiler, Register reg, uint64_t value) {
+    emitBytes(compiler, 2, 0x48, 0xB8 + reg);
+    emit64(compiler, value);
+}
+
+// mov reg, [r13 - 8 * distance]
+static void emitLoadStack(JitCompiler* compiler, Register reg, int distance) {
+    emitBytes(compiler, 4, 0x49, 0x8B, 0x45 | reg << 3, (uint8_t)(-8 * distance));
+}
+
+// mov [r13 - 8 * distance], reg
+static void emitStoreStack(JitCompiler* compiler, Register reg, int distance) {
+    emitBytes(compiler, 4, 0x49, 0x89, 0x45 | reg << 3, (uint8_t)(-8 * distance));
+}
+
+// add r13, 8 * count
+static void emitMoveStack(JitCompiler* compiler, int count) {
+    if (count > 0) {
+        emitBytes(compiler, 4, 0x49, 0x83, 0xC5, 8 * count);
+    } else {
+        emitBytes(compiler, 4, 0x49, 0x83, 0xED, -8 * count);
+    }
+}
+
+static void emitPush(JitCompiler* compiler, Register reg) {
+    emitStoreStack(compiler, reg, 0);
+    emitMoveStack(compiler, 1);
+}
+
+// Jumps away unless reg holds a number and returns the jump to patch.
+static int emitCheckNumber(JitCompiler* compiler, Register reg) {
+    emitBytes(compiler, 3, 0x48, 0x89, 0xC2 | reg << 3); // mov rdx, reg
+    emitBytes(compiler, 3, 0x48, 0x21, 0xEA);            // and rdx, rbp
+    emitBytes(compiler, 3, 0x48, 0x39, 0xEA);            // cmp rdx, rbp
+    return emitJump(compiler, JE);
+}
+
+// Turns the flag in al into a Value in rax.
+static void emitBoolFromFlag(JitCompiler* compiler) {
+    emitBytes(compiler, 3, 0x0F, 0xB6, 0xC0); // movzx eax, al
+    emitLoadImmediate(compiler, RCX, FALSE_VAL);
+    emitBytes(compiler, 3, 0x48, 0x01, 0xC8); // add rax, rcx
+}
+
+static void emitCall(JitCompiler* compiler, void* function) {
+    emitLoadImmediate(compiler, RAX, (uint64_t)(uintptr_t)function);
+    emitBytes(compiler, 2, 0xFF, 0xD0); // call rax
+}
+
+static void emitSyncStackTop(JitCompiler* compiler) {
+    emitBytes(compiler, 4, 0x4D, 0x89, 0x2C, 0x24); // mov [r12], r13
+}
+
+static void emitReloadStackTop(JitCompiler* compiler) {
+    emitBytes(compiler, 4, 0x4D, 0x8B, 0x2C, 0x24); // mov r13, [r12]
+}
+
+// Anything called out to may have grown the stacks and moved them, so this
+// finds the frame, which is back on top, and its slots again. Leaves rax alone.
+static void emitReloadFrame(JitCompiler* compiler) {
+    emitReloadStackTop(compiler);
+    emitBytes(compiler, 2, 0x48, 0xB9);             // mov rcx, &vm.frameCount
+    emit64(compiler, (uint64_t)(uintptr_t)&vm.frameCount);
+    emitBytes(compiler, 3, 0x48, 0x63, 0x11);       // movsxd rdx, dword [rcx]
+    emitBytes(compiler, 3, 0x48, 0x69, 0xD2);       // imul rdx, rdx, sizeof(CallFrame)
+    emit32(compiler, sizeof(CallFrame));
+    emitBytes(compiler, 2, 0x48, 0xB9);             // mov rcx, &vm.frames
+    emit64(compiler, (uint64_t)(uintptr_t)&vm.frames);
+    emitBytes(compiler, 3, 0x4C, 0x8B, 0x31);       // mov r14, [rcx]
+    emitBytes(compiler, 4, 0x4D, 0x8D, 0xB4, 0x16); // lea r14, [r14 + rdx - sizeof(CallFrame)]
+    emit32(compiler, (uint32_t)-(int32_t)sizeof(CallFrame));
+    emitBytes(compiler, 3, 0x49, 0x8B, 0x9E);       // mov rbx, [r14 + slots]
+    emit32(compiler, offsetof(CallFrame, slots));
+}
+
+// Runs the instruction whose operands start at ip through jitExecute().
+static void emitHelper(JitCompiler* compiler, uint8_t* ip, OpCode instruction) {
+    emitSyncStackTop(compiler);
+    emitBytes(compiler, 3, 0x4C, 0x89, 0xF7); // mov rdi, r14
+    emitBytes(compiler, 2, 0x48, 0xBE);       // mov rsi, ip
+    emit64(compiler, (uint64_t)(uintptr_t)ip);
+    emitByte(compiler, 0xBA);                 // mov edx, instruction
+    emit32(compiler, instruction);
+    emitCall(compiler, (void*)jitExecute);
+    emitReloadFrame(compiler);
+    emitBytes(compiler, 2, 0x84, 0xC0);       // test al, al
+    emitJumpTo(compiler, JE, compiler->errorExit);
+}
+
+// Jumps away if the object in reg is a concatenation, using rdx, which has
+// to hold SIGN_BIT | QNAN, and rsi.
+static int emitCheckConcat(JitCompiler* compiler, Register reg) {
+    emitBytes(compiler, 3, 0x48, 0x89, 0xC6 | reg << 3); // mov rsi, reg
+    emitBytes(compiler, 3, 0x48, 0x31, 0xD6);            // xor rsi, rdx
+    emitBytes(compiler, 2, 0x80, 0xBE);                  // cmp byte [rsi + type], OBJ_CONCAT
+    emit32(compiler, offsetof(Obj, type));
+    emitByte(compiler, OBJ_CONCAT);
+    return emitJump(compiler, JE);
+}
+
+// Sets al if rax and rcx, which aren't both numbers, are equal. Anything but
+// a number is equal only to itself, unless one is a concatenation, which
+// valuesEqual() flattens. It never calls back into the VM, so the stacks stay put. Every
+// comparison calls this one copy, which keeps the code for each small.
+static void emitEqualValues(JitCompiler* compiler) {
+    compiler->equalValues = compiler->count;
+    emitBytes(compiler, 3, 0x48, 0x89, 0xC6);       // mov rsi, rax
+    emitBytes(compiler, 3, 0x48, 0x21, 0xCE);       // and rsi, rcx
+    emitLoadImmediate(compiler, RDX, SIGN_BIT | QNAN);
+    emitBytes(compiler, 3, 0x48, 0x21, 0xD6);       // and rsi, rdx
+    emitBytes(compiler, 3, 0x48, 0x39, 0xD6);       // cmp rsi, rdx
+    int notObjects = emitJump(compiler, JNE);
+    int concatA = emitCheckConcat(compiler, RAX);
+    int concatB = emitCheckConcat(compiler, RCX);
+
+    patchHere(compiler, notObjects);
+    emitBytes(compiler, 3, 0x48, 0x39, 0xC8);       // cmp rax, rcx
+    emitBytes(compiler, 3, 0x0F, 0x94, 0xC0);       // sete al
+    emitByte(compiler, 0xC3);                       // ret
+
+    patchHere(compiler, concatA);
+    patchHere(compiler, concatB);
+    emitSyncStackTop(compiler);
+    emitBytes(compiler, 4, 0x48, 0x83, 0xEC, 0x08); // sub rsp, 8
+    emitBytes(compiler, 3, 0x48, 0x89, 0xC7);       // mov rdi, rax
+    emitBytes(compiler, 3, 0x48, 0x89, 0xCE);       // mov rsi, rcx
+    emitCall(compiler, (void*)valuesEqual);
+    emitBytes(compiler, 4, 0x48, 0x83, 0xC4, 0x08); // add rsp, 8
+    emitByte(compiler, 0xC3);                       // ret
+}
+
+// JitResult (*)(CallFrame* frame, uint8_t* target) that saves the registers
+// it uses, loads the interpreter's state and jumps to target. The error and
+// normal exits and emitEqualValues() follow it.
+static void emitPrologue(JitCompiler* compiler) {
+    emitBytes(compiler, 1, 0x55);                   // push rbp
+    emitBytes(compiler, 1, 0x53);                   // push rbx
+    emitBytes(compiler, 2, 0x41, 0x54);             // push r12
+    emitBytes(compiler, 2, 0x41, 0x55);             // push r13
+    emitBytes(compiler, 2, 0x41, 0x56);             // push r14
+    emitBytes(compiler, 2, 0x41, 0x57);             // push r15
+    emitBytes(compiler, 4, 0x48, 0x83, 0xEC, 0x08); // sub rsp, 8
+    emitBytes(compiler, 3, 0x49, 0x89, 0xFE);       // mov r14, rdi
+    emitBytes(compiler, 3, 0x49, 0x8B, 0x9E);       // mov rbx, [r14 + slots]
+    emit32(compiler, offsetof(CallFrame, slots));
+    emitBytes(compiler, 2, 0x49, 0xBC);             // mov r12, &vm.stackTop
+    emit64(compiler, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitReloadStackTop(compiler);
+    emitBytes(compiler, 2, 0x49, 0xBF);             // mov r15, &vm.globalValues.values
+    emit64(compiler, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    emitLoadImmediate(compiler, RAX, QNAN);
+    emitBytes(compiler, 3, 0x48, 0x89, 0xC5);       // mov rbp, rax
+    emitBytes(compiler, 2, 0xFF, 0xE6);             // jmp rsi
+
+    compiler->errorExit = compiler->count;
+    emitByte(compiler, 0xB8);                       // mov eax, JIT_ERROR
+    emit32(compiler, JIT_ERROR);
+
+    compiler->exit = compiler->count;
+    emitBytes(compiler, 4, 0x48, 0x83, 0xC4, 0x08); // add rsp, 8
+    emitBytes(compiler, 2, 0x41, 0x5F);             // pop r15
+    emitBytes(compiler, 2, 0x41, 0x5E);             // pop r14
+    emitBytes(compiler, 2, 0x41, 0x5D);             // pop r13
+    emitBytes(compiler, 2, 0x41, 0x5C);             // pop r12
+    emitBytes(compiler, 1, 0x5B);                   // pop rbx
+    emitBytes(compiler, 1, 0x5D);                   // pop rbp
+    emitBytes(compiler, 1, 0xC3);                   // ret
+
+    emitEqualValues(compiler);
+    compiler->body = compiler->count;
+}
+
+// Superinstructions and quickened instructions keep the bytes of what they
+// replaced, so they compile as the first instruction they stand for.
+static OpCode baseOpcode(OpCode instruction) {
+    switch (instruction) {
+        case OP_ADD_NUM:
+            return OP_ADD;
+        case OP_LESS_NUM:
+        case OP_LESS_JUMP_IF_FALSE:
+            return OP_LESS;
+        case OP_GREATER_NUM:
+            return OP_GREATER;
+        case OP_GET_LOCAL_LOCAL:
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_GET_THIS_PROPERTY:
+            return OP_GET_LOCAL;
+        default:
+            return instruction;
+    }
+}
+
+// Number fast path of a binary instruction; jitExecute() does the rest.
+static void compileBinary(JitCompiler* compiler, uint8_t* ip, OpCode instruction) {
+    emitLoadStack(compiler, RAX, 2);
+    emitLoadStack(compiler, RCX, 1);
+    int notNumberA = emitCheckNumber(compiler, RAX);
+    int notNumberB = emitCheckNumber(compiler, RCX);
+    emitBytes(compiler, 5, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+    emitBytes(compiler, 5, 0x66, 0x48, 0x0F, 0x6E, 0xC9); // movq xmm1, rcx
+
+    switch (instruction) {
+        case OP_ADD:      emitBytes(compiler, 4, 0xF2, 0x0F, 0x58, 0xC1); break; // addsd
+        case OP_SUBTRACT: emitBytes(compiler, 4, 0xF2, 0x0F, 0x5C, 0xC1); break; // subsd
+        case OP_MULTIPLY: emitBytes(compiler, 4, 0xF2, 0x0F, 0x59, 0xC1); break; // mulsd
+        case OP_DIVIDE:   emitBytes(compiler, 4, 0xF2, 0x0F, 0x5E, 0xC1); break; // divsd
+        case OP_LESS:     emitBytes(compiler, 4, 0x66, 0x0F, 0x2E, 0xC8); break; // ucomisd xmm1, xmm0
+        case OP_GREATER:  emitBytes(compiler, 4, 0x66, 0x0F, 0x2E, 0xC1); break; // ucomisd xmm0, xmm1
+        default: break; // Unreachable.
+    }
+
+    if (instruction == OP_LESS || instruction == OP_GREATER) {
+        // seta is false when either side is NaN, like C's < and >.
+        emitBytes(compiler, 3, 0x0F, 0x97, 0xC0); // seta al
+        emitBoolFromFlag(compiler);
+    } else {
+        emitBytes(compiler, 5, 0x66, 0x48, 0x0F, 0x7E, 0xC0); // movq rax, xmm0
+    }
+    emitStoreStack(compiler, RAX, 2);
+    emitMoveStack(compiler, -1);
+
+    int done = emitJump(compiler, JMP);
+    patchHere(compiler, notNumberA);
+    patchHere(compiler, notNumberB);
+    emitHelper(compiler, ip, instruction);
+    patchHere(compiler, done);
+}
+
+static void compileUnary(JitCompiler* compiler, uint8_t* ip, OpCode instruction) {
+    emitLoadStack(compiler, RAX, 1);
+    int notNumber = emitCheckNumber(compiler, RAX);
+
+    if (instruction == OP_NEGATE) {
+        emitLoadImmediate(compiler, RCX, SIGN_BIT);
+        emitBytes(compiler, 3, 0x48, 0x31, 0xC8);             // xor rax, rcx
+    } else {
+        emitBytes(compiler, 5, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+        emitLoadImmediate(compiler, RCX, NUMBER_VAL(1));
+        emitBytes(compiler, 5, 0x66, 0x48, 0x0F, 0x6E, 0xC9); // movq xmm1, rcx
+        if (instruction == OP_INCREMENT) {
+            emitBytes(compiler, 4, 0xF2, 0x0F, 0x58, 0xC1);   // addsd xmm0, xmm1
+        } else {
+            emitBytes(compiler, 4, 0xF2, 0x0F, 0x5C, 0xC1);   // subsd xmm0, xmm1
+        }
+        emitBytes(compiler, 5, 0x66, 0x48, 0x0F, 0x7E, 0xC0); // movq rax, xmm0
+    }
+    emitStoreStack(compiler, RAX, 1);
+
+    int done = emitJump(compiler, JMP);
+    patchHere(compiler, notNumber);
+    emitHelper(compiler, ip, instruction);
+    patchHere(compiler, done);
+}
+
+static void compileEqual(JitCompiler* compiler) {
+    emitLoadStack(compiler, RAX, 2);
+    emitLoadStack(compiler, RCX, 1);
+    int notNumberA = emitCheckNumber(compiler, RAX);
+    int notNumberB = emitCheckNumber(compiler, RCX);
+    emitBytes(compiler, 5, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+    emitBytes(compiler, 5, 0x66, 0x48, 0x0F, 0x6E, 0xC9); // movq xmm1, rcx
+    emitBytes(compiler, 4, 0x66, 0x0F, 0x2E, 0xC1);       // ucomisd xmm0, xmm1
+    emitBytes(compiler, 3, 0x0F, 0x94, 0xC0);             // sete al
+    emitBytes(compiler, 3, 0x0F, 0x9B, 0xC2);             // setnp dl
+    emitBytes(compiler, 2, 0x20, 0xD0);                   // and al, dl
+    int done = emitJump(compiler, JMP);
+
+    // Only objects and negative numbers have the sign bit set, so any other
+    // pair is equal only if it is the same value.
+    patchHere(compiler, notNumberA);
+    patchHere(compiler, notNumberB);
+    emitBytes(compiler, 3, 0x48, 0x89, 0xCE);             // mov rsi, rcx
+    emitBytes(compiler, 3, 0x48, 0x21, 0xC6);             // and rsi, rax
+    int bothSigned = emitJump(compiler, JS);
+    emitBytes(compiler, 3, 0x48, 0x39, 0xC8);             // cmp rax, rcx
+    emitBytes(compiler, 3, 0x0F, 0x94, 0xC0);             // sete al
+    int same = emitJump(compiler, JMP);
+    patchHere(compiler, bothSigned);
+    emitByte(compiler, 0xE8);                             // call equalValues
+    emit32(compiler, (uint32_t)(compiler->equalValues - (compiler->count + 4)));
+    patchHere(compiler, same);
+
+    patchHere(compiler, done);
+    emitBoolFromFlag(compiler);
+    emitStoreStack(compiler, RAX, 2);
+    emitMoveStack(compiler, -1);
+}
+
+// Jumps away unless rax holds an object of the given type, and leaves the
+// Obj* in rax otherwise.
+static void emitUnwrapObject(JitCompiler* compiler, ObjType type, int* slowJumps) {
+    emitLoadImmediate(compiler, RCX, SIGN_BIT | QNAN);
+    emitBytes(compiler, 3, 0x48, 0x89, 0xC2); // mov rdx, rax
+    emitBytes(compiler, 3, 0x48, 0x21, 0xCA); // and rdx, rcx
+    emitBytes(compiler, 3, 0x48, 0x39, 0xCA); // cmp rdx, rcx
+    slowJumps[0] = emitJump(compiler, JNE);
+    emitBytes(compiler, 3, 0x48, 0x31, 0xC8); // xor rax, rcx
+    emitBytes(compiler, 2, 0x80, 0xB8);       // cmp byte [rax + type], type
+    emit32(compiler, offsetof(Obj, type));
+    emitByte(compiler, type);
+    slowJumps[1] = emitJump(compiler, JNE);
+}
+
+// With the ObjInstance* in rax, jumps away unless the site's cache has the
+// instance's shape. Otherwise leaves the fields in rax and the slot in rcx.
+static void emitCachedSlot(JitCompiler* compiler, InlineCache* cache, int* slowJumps) {
+    emitBytes(compiler, 2, 0x48, 0xBA);             // mov rdx, cache
+    emit64(compiler, (uint64_t)(uintptr_t)cache);
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x88);       // mov rcx, [rax + shape]
+    emit32(compiler, offsetof(ObjInstance, shape));
+    emitBytes(compiler, 3, 0x48, 0x3B, 0x8A);       // cmp rcx, [rdx + shape]
+    emit32(compiler, offsetof(InlineCache, shape));
+    slowJumps[0] = emitJump(compiler, JNE);
+    emitBytes(compiler, 3, 0x48, 0x83, 0xBA);       // cmp qword [rdx + transition], 0
+    emit32(compiler, offsetof(InlineCache, transition));
+    emitByte(compiler, 0);
+    slowJumps[1] = emitJump(compiler, JNE);
+    emitBytes(compiler, 3, 0x48, 0x63, 0x8A);       // movsxd rcx, dword [rdx + slot]
+    emit32(compiler, offsetof(InlineCache, slot));
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x80);       // mov rax, [rax + fields]
+    emit32(compiler, offsetof(ObjInstance, fields));
+}
+
+static void compileGetProperty(JitCompiler* compiler, Chunk* chunk, uint8_t* ip) {
+    int slow[4];
+    emitLoadStack(compiler, RAX, 1);
+    emitUnwrapObject(compiler, OBJ_INSTANCE, slow);
+    emitCachedSlot(compiler, &chunk->caches[ip[0]], slow + 2);
+    emitBytes(compiler, 4, 0x48, 0x8B, 0x04, 0xC8); // mov rax, [rax + 8 * rcx]
+    emitStoreStack(compiler, RAX, 1);
+
+    int done = emitJump(compiler, JMP);
+    for (int i = 0; i < 4; i++) patchHere(compiler, slow[i]);
+    emitHelper(compiler, ip, OP_GET_PROPERTY);
+    patchHere(compiler, done);
+}
+
+static void compileSetProperty(JitCompiler* compiler, Chunk* chunk, uint8_t* ip) {
+    int slow[6];
+    emitLoadStack(compiler, RAX, 2);
+    emitUnwrapObject(compiler, OBJ_INSTANCE, slow);
+    emitBytes(compiler, 2, 0x80, 0xB8);             // cmp byte [rax + isStatic], 0
+    emit32(compiler, offsetof(ObjInstance, isStatic));
+    emitByte(compiler, 0);
+    slow[2] = emitJump(compiler, JNE);
+    // Storing an object into an old instance needs the write barrier.
+    emitBytes(compiler, 2, 0x80, 0xB8);             // cmp byte [rax + isYoung], 0
+    emit32(compiler, offsetof(Obj, isYoung));
+    emitByte(compiler, 0);
+    int young = emitJump(compiler, JNE);
+    emitLoadStack(compiler, RDX, 1);
+    emitBytes(compiler, 3, 0x48, 0x21, 0xCA);       // and rdx, rcx
+    emitBytes(compiler, 3, 0x48, 0x39, 0xCA);       // cmp rdx, rcx
+    slow[3] = emitJump(compiler, JE);
+    patchHere(compiler, young);
+    emitCachedSlot(compiler, &chunk->caches[ip[0]], slow + 4);
+    emitLoadStack(compiler, RDX, 1);
+    emitBytes(compiler, 4, 0x48, 0x89, 0x14, 0xC8); // mov [rax + 8 * rcx], rdx
+    emitStoreStack(compiler, RDX, 2);
+    emitMoveStack(compiler, -1);
+
+    int done = emitJump(compiler, JMP);
+    for (int i = 0; i < 6; i++) patchHere(compiler, slow[i]);
+    emitHelper(compiler, ip, OP_SET_PROPERTY);
+    patchHere(compiler, done);
+}
+
+// Slow-path jumps of a fast path that are all patched to the same place.
+typedef struct {
+    int jumps[16];
+    int count;
+} SlowPath;
+
+static void addSlowJump(SlowPath* slow, int at) {
+    slow->jumps[slow->count++] = at;
+}
+
+static void patchSlowPath(JitCompiler* compiler, SlowPath* slow) {
+    for (int i = 0; i < slow->count; i++) patchHere(compiler, slow->jumps[i]);
+}
+
+// With the ObjClosure* in rax and its receiver and arguments on the stack,
+// pushes the callee's frame and runs its compiled code. Leaves for the slow
+// path when the callee isn't compiled, the arity is wrong or the stacks have
+// to grow, so call() handles those.
+static void emitEnterClosure(JitCompiler* compiler, uint8_t* next, int argCount, SlowPath* slow) {
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x90);       // mov rdx, [rax + function]
+    emit32(compiler, offsetof(ObjClosure, function));
+    emitBytes(compiler, 2, 0x83, 0xBA);             // cmp dword [rdx + arity], argCount
+    emit32(compiler, offsetof(ObjFunction, arity));
+    emitByte(compiler, argCount);
+    addSlowJump(slow, emitJump(compiler, JNE));
+    emitBytes(compiler, 3, 0x48, 0x8B, 0xB2);       // mov rsi, [rdx + jit]
+    emit32(compiler, offsetof(ObjFunction, jit));
+    emitBytes(compiler, 3, 0x48, 0x85, 0xF6);       // test rsi, rsi
+    addSlowJump(slow, emitJump(compiler, JE));
+    emitBytes(compiler, 2, 0x48, 0xBF);             // mov rdi, &vm.frameCount
+    emit64(compiler, (uint64_t)(uintptr_t)&vm.frameCount);
+    emitBytes(compiler, 2, 0x8B, 0x0F);             // mov ecx, [rdi]
+    emitBytes(compiler, 3, 0x3B, 0x4F,              // cmp ecx, [rdi + frameCapacity]
+              (uint8_t)(offsetof(VM, frameCapacity) - offsetof(VM, frameCount)));
+    addSlowJump(slow, emitJump(compiler, JGE));
+    emitBytes(compiler, 2, 0xFF, 0x07);             // inc dword [rdi]
+
+    emitBytes(compiler, 2, 0x69, 0xC9);             // imul ecx, ecx, sizeof(CallFrame)
+    emit32(compiler, sizeof(CallFrame));
+    emitBytes(compiler, 2, 0x48, 0xBF);             // mov rdi, &vm.frames
+    emit64(compiler, (uint64_t)(uintptr_t)&vm.frames);
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x3F);       // mov rdi, [rdi]
+    emitBytes(compiler, 3, 0x48, 0x01, 0xCF);       // add rdi, rcx
+    emitBytes(compiler, 3, 0x48, 0x89, 0x87);       // mov [rdi + closure], rax
+    emit32(compiler, offsetof(CallFrame, closure));
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x82);       // mov rax, [rdx + chunk.code]
+    emit32(compiler, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+    emitBytes(compiler, 3, 0x48, 0x89, 0x87);       // mov [rdi + ip], rax
+    emit32(compiler, offsetof(CallFrame, ip));
+    emitBytes(compiler, 4, 0x49, 0x8D, 0x45, (uint8_t)(-8 * (argCount + 1))); // lea rax, [receiver]
+    emitBytes(compiler, 3, 0x48, 0x89, 0x87);       // mov [rdi + slots], rax
+    emit32(compiler, offsetof(CallFrame, slots));
+    emitBytes(compiler, 2, 0xC6, 0x87);             // mov byte [rdi + callClosure], 0
+    emit32(compiler, offsetof(CallFrame, callClosure));
+    emitByte(compiler, 0);
+
+    // Stack traces read the caller's ip.
+    emitLoadImmediate(compiler, RAX, (uint64_t)(uintptr_t)next);
+    emitBytes(compiler, 3, 0x49, 0x89, 0x86);       // mov [r14 + ip], rax
+    emit32(compiler, offsetof(CallFrame, ip));
+    emitSyncStackTop(compiler);
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x86);       // mov rax, [rsi + code]
+    emit32(compiler, offsetof(JitCode, code));
+    emitBytes(compiler, 3, 0x48, 0x8D, 0xB0);       // lea rsi, [rax + body]
+    emit32(compiler, compiler->body);
+    emitBytes(compiler, 2, 0xFF, 0xD0);             // call rax
+    emitReloadFrame(compiler);
+    emitBytes(compiler, 3, 0x83, 0xF8, JIT_ERROR);  // cmp eax, JIT_ERROR
+    emitJumpTo(compiler, JE, compiler->errorExit);
+
+    // The callee's frame now runs some other function, so it still has to be
+    // finished off.
+    emitBytes(compiler, 3, 0x83, 0xF8, JIT_TAIL_CALLED); // cmp eax, JIT_TAIL_CALLED
+    int returned = emitJump(compiler, JNE);
+    emitCall(compiler, (void*)jitResume);
+    emitReloadFrame(compiler);
+    emitBytes(compiler, 2, 0x84, 0xC0);             // test al, al
+    emitJumpTo(compiler, JE, compiler->errorExit);
+    patchHere(compiler, returned);
+}
+
+static void compileCall(JitCompiler* compiler, uint8_t* ip) {
+    int argCount = ip[0];
+    // Past 14 arguments the callee is out of reach of an 8-bit displacement.
+    if (argCount > 14) {
+        emitHelper(compiler, ip, OP_CALL);
+        return;
+    }
+
+    SlowPath slow = {0};
+    int notClosure[2];
+    emitLoadStack(compiler, RAX, argCount + 1);
+    emitUnwrapObject(compiler, OBJ_CLOSURE, notClosure);
+    addSlowJump(&slow, notClosure[0]);
+    int enter = compiler->count;
+    emitEnterClosure(compiler, ip + 1, argCount, &slow);
+    int done = emitJump(compiler, JMP);
+
+    // Classes whose initializer is compiled enter it the same way, once
+    // jitConstruct() has made the instance.
+    patchHere(compiler, notClosure[1]);
+    emitBytes(compiler, 2, 0x80, 0xB8);             // cmp byte [rax + type], OBJ_CLASS
+    emit32(compiler, offsetof(Obj, type));
+    emitByte(compiler, OBJ_CLASS);
+    addSlowJump(&slow, emitJump(compiler, JNE));
+    emitSyncStackTop(compiler);
+    emitBytes(compiler, 3, 0x48, 0x89, 0xC7);       // mov rdi, rax
+    emitByte(compiler, 0xBE);                       // mov esi, argCount
+    emit32(compiler, argCount);
+    emitCall(compiler, (void*)jitConstruct);
+    emitBytes(compiler, 3, 0x48, 0x85, 0xC0);       // test rax, rax
+    emitJumpTo(compiler, JNE, enter);
+
+    patchSlowPath(compiler, &slow);
+    emitHelper(compiler, ip, OP_CALL);
+    patchHere(compiler, done);
+}
+
+// A tail call to a closure replaces the function the frame runs, so the code
+// compiled for this one leaves and whoever entered it carries on the frame.
+static void compileTailCall(JitCompiler* compiler, uint8_t* ip) {
+    emitSyncStackTop(compiler);
+    emitBytes(compiler, 3, 0x4C, 0x89, 0xF7);       // mov rdi, r14
+    emitBytes(compiler, 2, 0x48, 0xBE);             // mov rsi, ip
+    emit64(compiler, (uint64_t)(uintptr_t)ip);
+    emitCall(compiler, (void*)jitTailCall);
+    emitReloadFrame(compiler);
+    emitBytes(compiler, 3, 0x83, 0xF8, JIT_ERROR);  // cmp eax, JIT_ERROR
+    emitJumpTo(compiler, JE, compiler->errorExit);
+    emitBytes(compiler, 3, 0x83, 0xF8, JIT_TAIL_CALLED); // cmp eax, JIT_TAIL_CALLED
+    emitJumpTo(compiler, JE, compiler->exit);
+}
+
+// Method calls on instances whose shape is the first one the site's invoke
+// cache remembers, while their class's methods are unchanged, go straight to
+// the cached closure.
+static void compileInvoke(JitCompiler* compiler, Chunk* chunk, uint8_t* ip) {
+    int argCount = ip[1];
+    if (argCount > 14) {
+        emitHelper(compiler, ip, OP_INVOKE);
+        return;
+    }
+
+    SlowPath slow = {0};
+    emitLoadStack(compiler, RAX, argCount + 1);
+    emitUnwrapObject(compiler, OBJ_INSTANCE, slow.jumps);
+    slow.count = 2;
+    emitBytes(compiler, 2, 0x80, 0xB8);             // cmp byte [rax + isStatic], 0
+    emit32(compiler, offsetof(ObjInstance, isStatic));
+    emitByte(compiler, 0);
+    addSlowJump(&slow, emitJump(compiler, JNE));
+
+    emitBytes(compiler, 2, 0x48, 0xBA);             // mov rdx, cache
+    emit64(compiler, (uint64_t)(uintptr_t)&chunk->caches[ip[0]]);
+    emitBytes(compiler, 2, 0x83, 0xBA);             // cmp dword [rdx + methodCount], 0
+    emit32(compiler, offsetof(InlineCache, methodCount));
+    emitByte(compiler, 0);
+    addSlowJump(&slow, emitJump(compiler, JE));
+    emitBytes(compiler, 3, 0x48, 0x8B, 0xB2);       // mov rsi, [rdx + methods]
+    emit32(compiler, offsetof(InlineCache, methods));
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x88);       // mov rcx, [rax + shape]
+    emit32(compiler, offsetof(ObjInstance, shape));
+    emitBytes(compiler, 3, 0x48, 0x3B, 0x8E);       // cmp rcx, [rsi + receiver]
+    emit32(compiler, offsetof(MethodCacheEntry, receiver));
+    addSlowJump(&slow, emitJump(compiler, JNE));
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x88);       // mov rcx, [rax + klass]
+    emit32(compiler, offsetof(ObjInstance, klass));
+    emitBytes(compiler, 2, 0x8B, 0x89);             // mov ecx, [rcx + methodEpoch]
+    emit32(compiler, offsetof(ObjClass, methodEpoch));
+    emitBytes(compiler, 2, 0x3B, 0x8E);             // cmp ecx, [rsi + epoch]
+    emit32(compiler, offsetof(MethodCacheEntry, epoch));
+    addSlowJump(&slow, emitJump(compiler, JNE));
+
+    // Methods of instances that aren't static are always closures.
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x86);       // mov rax, [rsi + method]
+    emit32(compiler, offsetof(MethodCacheEntry, method));
+    emitLoadImmediate(compiler, RCX, SIGN_BIT | QNAN);
+    emitBytes(compiler, 3, 0x48, 0x31, 0xC8);       // xor rax, rcx
+    emitEnterClosure(compiler, ip + 2, argCount, &slow);
+
+    int done = emitJump(compiler, JMP);
+    patchSlowPath(compiler, &slow);
+    emitHelper(compiler, ip, OP_INVOKE);
+    patchHere(compiler, done);
+}
+
+// Returns into an ordinary caller frame inline. jitReturn() handles closing
+// upvalues and the frames run() has to stop at.
+static void compileReturn(JitCompiler* compiler) {
+    int slow[3];
+    emitLoadImmediate(compiler, RAX, (uint64_t)(uintptr_t)&vm.openUpvalues);
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x00);       // mov rax, [rax]
+    emitBytes(compiler, 3, 0x48, 0x85, 0xC0);       // test rax, rax
+    int noUpvalues = emitJump(compiler, JE);
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x80);       // mov rax, [rax + location]
+    emit32(compiler, offsetof(ObjUpvalue, location));
+    emitBytes(compiler, 3, 0x48, 0x39, 0xD8);       // cmp rax, rbx
+    slow[0] = emitJump(compiler, JAE);
+    patchHere(compiler, noUpvalues);
+
+    emitBytes(compiler, 3, 0x41, 0x80, 0xBE);       // cmp byte [r14 + callClosure], 0
+    emit32(compiler, offsetof(CallFrame, callClosure));
+    emitByte(compiler, 0);
+    slow[1] = emitJump(compiler, JNE);
+    emitLoadImmediate(compiler, RAX, (uint64_t)(uintptr_t)&vm.frameCount);
+    emitBytes(compiler, 3, 0x83, 0x38, 0x01);       // cmp dword [rax], 1
+    slow[2] = emitJump(compiler, JLE);
+    emitBytes(compiler, 2, 0xFF, 0x08);             // dec dword [rax]
+
+    emitLoadStack(compiler, RAX, 1);
+    emitBytes(compiler, 3, 0x48, 0x89, 0x03);       // mov [rbx], rax
+    emitBytes(compiler, 4, 0x4C, 0x8D, 0x6B, 0x08); // lea r13, [rbx + 8]
+    emitSyncStackTop(compiler);
+    emitByte(compiler, 0xB8);                       // mov eax, JIT_RETURNED
+    emit32(compiler, JIT_RETURNED);
+    emitJumpTo(compiler, JMP, compiler->exit);
+
+    for (int i = 0; i < 3; i++) patchHere(compiler, slow[i]);
+    emitSyncStackTop(compiler);
+    emitBytes(compiler, 3, 0x4C, 0x89, 0xF7);       // mov rdi, r14
+    emitCall(compiler, (void*)jitReturn);
+    emitJumpTo(compiler, JMP, compiler->exit);
+}
+
+// Leaves the address of upvalue slot's location in rax.
+static void emitUpvalueLocation(JitCompiler* compiler, int slot) {
+    emitBytes(compiler, 3, 0x49, 0x8B, 0x86); // mov rax, [r14 + closure]
+    emit32(compiler, offsetof(CallFrame, closure));
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x80); // mov rax, [rax + upvalues]
+    emit32(compiler, offsetof(ObjClosure, upvalues));
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x80); // mov rax, [rax + 8 * slot]
+    emit32(compiler, 8 * slot);
+    emitBytes(compiler, 3, 0x48, 0x8B, 0x80); // mov rax, [rax + location]
+    emit32(compiler, offsetof(ObjUpvalue, location));
+}
+
+// Objects go through jitExecute(), which applies the write barrier.
+static void compileSetUpvalue(JitCompiler* compiler, uint8_t* ip) {
+    emitLoadStack(compiler, RCX, 1);
+    emitLoadImmediate(compiler, RDX, SIGN_BIT | QNAN);
+    emitBytes(compiler, 3, 0x48, 0x89, 0xC8); // mov rax, rcx
+    emitBytes(compiler, 3, 0x48, 0x21, 0xD0); // and rax, rdx
+    emitBytes(compiler, 3, 0x48, 0x39, 0xD0); // cmp rax, rdx
+    int slow = emitJump(compiler, JE);
+    emitUpvalueLocation(compiler, ip[0]);
+    emitBytes(compiler, 3, 0x48, 0x89, 0x08); // mov [rax], rcx
+
+    int done = emitJump(compiler, JMP);
+    patchHere(compiler, slow);
+    emitHelper(compiler, ip, OP_SET_UPVALUE);
+    patchHere(compiler, done);
+}
+
+// Compiles the instruction at offset and returns its length, or 0 if it
+// can't be compiled.
+static int compileInstruction(JitCompiler* compiler, Chunk* chunk, int offset) {
+    uint8_t* ip = chunk->code + offset + 1;
+    OpCode instruction = baseOpcode(chunk->code[offset]);
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            emitLoadImmediate(compiler, RAX, chunk->constants.values[ip[0]]);
+            emitPush(compiler, RAX);
+            return 2;
+        case OP_NIL:
+            emitLoadImmediate(compiler, RAX, NIL_VAL);
+            emitPush(compiler, RAX);
+            return 1;
+        case OP_TRUE:
+            emitLoadImmediate(compiler, RAX, TRUE_VAL);
+            emitPush(compiler, RAX);
+            return 1;
+        case OP_FALSE:
+            emitLoadImmediate(compiler, RAX, FALSE_VAL);
+            emitPush(compiler, RAX);
+            return 1;
+        case OP_POP:
+            emitMoveStack(compiler, -1);
+            return 1;
+        case OP_DUP:
+            emitLoadStack(compiler, RAX, 1);
+            emitPush(compiler, RAX);
+            return 1;
+        case OP_DOUBLE_DUP:
+            emitLoadStack(compiler, RAX, 2);
+            emitLoadStack(compiler, RCX, 1);
+            emitStoreStack(compiler, RAX, 0);
+            emitStoreStack(compiler, RCX, -1);
+            emitMoveStack(compiler, 2);
+            return 1;
+        case OP_GET_LOCAL:
+            emitBytes(compiler, 3, 0x48, 0x8B, 0x83); // mov rax, [rbx + 8 * slot]
+            emit32(compiler, 8 * ip[0]);
+            emitPush(compiler, RAX);
+            return 2;
+        case OP_SET_LOCAL:
+            emitLoadStack(compiler, RAX, 1);
+            emitBytes(compiler, 3, 0x48, 0x89, 0x83); // mov [rbx + 8 * slot], rax
+            emit32(compiler, 8 * ip[0]);
+            return 2;
+        case OP_GET_GLOBAL: {
+            int slot = (ip[0] << 8) | ip[1];
+            emitBytes(compiler, 3, 0x49, 0x8B, 0x0F); // mov rcx, [r15]
+            emitBytes(compiler, 3, 0x48, 0x8B, 0x81); // mov rax, [rcx + 8 * slot]
+            emit32(compiler, 8 * slot);
+            emitLoadImmediate(compiler, RDX, UNDEFINED_VAL);
+            emitBytes(compiler, 3, 0x48, 0x39, 0xD0); // cmp rax, rdx
+            int undefined = emitJump(compiler, JE);
+            emitPush(compiler, RAX);
+            int done = emitJump(compiler, JMP);
+            patchHere(compiler, undefined);
+            emitHelper(compiler, ip, instruction);
+            patchHere(compiler, done);
+            return 3;
+        }
+        case OP_DEFINE_GLOBAL: {
+            int slot = (ip[0] << 8) | ip[1];
+            emitLoadStack(compiler, RAX, 1);
+            emitBytes(compiler, 3, 0x49, 0x8B, 0x0F); // mov rcx, [r15]
+            emitBytes(compiler, 3, 0x48, 0x89, 0x81); // mov [rcx + 8 * slot], rax
+            emit32(compiler, 8 * slot);
+            emitMoveStack(compiler, -1);
+            return 3;
+        }
+        case OP_SET_GLOBAL: {
+            int slot = (ip[0] << 8) | ip[1];
+            emitBytes(compiler, 3, 0x49, 0x8B, 0x0F); // mov rcx, [r15]
+            emitBytes(compiler, 3, 0x48, 0x8B, 0x81); // mov rax, [rcx + 8 * slot]
+            emit32(compiler, 8 * slot);
+            emitLoadImmediate(compiler, RDX, UNDEFINED_VAL);
+            emitBytes(compiler, 3, 0x48, 0x39, 0xD0); // cmp rax, rdx
+            int undefined = emitJump(compiler, JE);
+            emitLoadStack(compiler, RAX, 1);
+            emitBytes(compiler, 3, 0x48, 0x89, 0x81); // mov [rcx + 8 * slot], rax
+            emit32(compiler, 8 * slot);
+            int done = emitJump(compiler, JMP);
+            patchHere(compiler, undefined);
+            emitHelper(compiler, ip, instruction);
+            patchHere(compiler, done);
+            return 3;
+        }
+        case OP_GET_UPVALUE:
+            emitUpvalueLocation(compiler, ip[0]);
+            emitBytes(compiler, 3, 0x48, 0x8B, 0x00); // mov rax, [rax]
+            emitPush(compiler, RAX);
+            return 2;
+        case OP_SET_UPVALUE:
+            compileSetUpvalue(compiler, ip);
+            return 2;
+        case OP_EQUAL:
+            compileEqual(compiler);
+            return 1;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS:
+        case OP_GREATER:
+            compileBinary(compiler, ip, instruction);
+            return 1;
+        case OP_INCREMENT:
+        case OP_DECREMENT:
+        case OP_NEGATE:
+            compileUnary(compiler, ip, instruction);
+            return 1;
+        case OP_NOT:
+            emitLoadStack(compiler, RAX, 1);
+            emitLoadImmediate(compiler, RCX, NIL_VAL);
+            emitBytes(compiler, 3, 0x48, 0x39, 0xC8); // cmp rax, rcx
+            emitBytes(compiler, 3, 0x0F, 0x94, 0xC2); // sete dl
+            emitLoadImmediate(compiler, RCX, FALSE_VAL);
+            emitBytes(compiler, 3, 0x48, 0x39, 0xC8); // cmp rax, rcx
+            emitBytes(compiler, 3, 0x0F, 0x94, 0xC0); // sete al
+            emitBytes(compiler, 2, 0x08, 0xD0);       // or al, dl
+            emitBoolFromFlag(compiler);
+            emitStoreStack(compiler, RAX, 1);
+            return 1;
+        case OP_JUMP:
+            emitBytecodeJump(compiler, JMP, offset + 3 + ((ip[0] << 8) | ip[1]));
+            return 3;
+        case OP_JUMP_IF_FALSE: {
+            int target = offset + 3 + ((ip[0] << 8) | ip[1]);
+            emitLoadStack(compiler, RAX, 1);
+            emitLoadImmediate(compiler, RCX, NIL_VAL);
+            emitBytes(compiler, 3, 0x48, 0x39, 0xC8); // cmp rax, rcx
+            emitBytecodeJump(compiler, JE, target);
+            emitLoadImmediate(compiler, RCX, FALSE_VAL);
+            emitBytes(compiler, 3, 0x48, 0x39, 0xC8); // cmp rax, rcx
+            emitBytecodeJump(compiler, JE, target);
+            return 3;
+        }
+        case OP_LOOP:
+            emitBytecodeJump(compiler, JMP, offset + 3 - ((ip[0] << 8) | ip[1]));
+            return 3;
+        case OP_RETURN:
+            compileReturn(compiler);
+            return 1;
+        case OP_GET_PROPERTY:
+            compileGetProperty(compiler, chunk, ip);
+            return 2;
+        case OP_SET_PROPERTY:
+            compileSetProperty(compiler, chunk, ip);
+            return 2;
+        case OP_CALL:
+            compileCall(compiler, ip);
+            return 2;
+        case OP_TAIL_CALL:
+            compileTailCall(compiler, ip);
+            return 2;
+        case OP_INVOKE:
+            compileInvoke(compiler, chunk, ip);
+            return 3;
+
+        case OP_MODULO:
+        case OP_BITWISE_NOT:
+        case OP_BITWISE_AND:
+        case OP_BITWISE_OR:
+        case OP_BITWISE_XOR:
+        case OP_BITWISE_LEFT_SHIFT:
+        case OP_BITWISE_RIGHT_SHIFT:
+        case OP_INDEX_SUBSCR:
+        case OP_STORE_SUBSCR:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+            emitHelper(compiler, ip, instruction);
+            return 1;
+        case OP_GET_SUPER:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
+        case OP_CLASS:
+        case OP_METHOD:
+            emitHelper(compiler, ip, instruction);
+            return 2;
+        case OP_SUPER_INVOKE:
+            emitHelper(compiler, ip, instruction);
+            return 3;
+        case OP_CLOSURE: {
+            emitHelper(compiler, ip, instruction);
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[ip[0]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        default:
+            return 0;
+    }
+}
+
+static void freeJitCompiler(JitCompiler* compiler) {
+    free(compiler->code);
+    free(compiler->jumps);
+}
+
+void jitCompile(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    JitCompiler compiler = {0};
+    compiler.offsets = malloc(sizeof(int) * chunk->count);
+    if (compiler.offsets == NULL) exit(1);
+    for (int i = 0; i < chunk->count; i++) compiler.offsets[i] = -1;
+
+    emitPrologue(&compiler);
+    for (int offset = 0; offset < chunk->count;) {
+        compiler.offsets[offset] = compiler.count;
+        int length = compileInstruction(&compiler, chunk, offset);
+        if (length == 0) goto fail;
+        offset += length;
+    }
+
+    for (int i = 0; i < compiler.jumpCount; i++) {
+        Jump* jump = &compiler.jumps[i];
+        if (jump->target < 0 || jump->target >= chunk->count ||
+            compiler.offsets[jump->target] == -1) goto fail;
+        patchJump(&compiler, jump->at, compiler.offsets[jump->target]);
+    }
+
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (compiler.count + pageSize - 1) / pageSize * pageSize;
+    uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) goto fail;
+    memcpy(code, compiler.code, compiler.count);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        goto fail;
+    }
+
+    JitCode* jit = malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->code = code;
+    jit->size = size;
+    jit->offsets = compiler.offsets;
+    function->jit = jit;
+    freeJitCompiler(&compiler);
+    return;
+
+fail:
+    // The function just stays in the interpreter.
+    free(compiler.offsets);
+    freeJitCompiler(&compiler);
+}
+
+JitResult jitRun(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    JitCode* jit = function->jit;
+    int offset = jit->offsets[frame->ip - function->chunk.code];
+    JitResult (*entry)(CallFrame*, uint8_t*) = (JitResult (*)(CallFrame*, uint8_t*))jit->code;
+    return entry(frame, jit->code + offset);
+}
+
+void jitFree(ObjFunction* function) {
+    if (function->jit == NULL) return;
+    munmap(function->jit->code, function->jit->size);
+    free(function->jit->offsets);
+    free(function->jit);
+}
@@ -0,0 +1,45 @@
+//
+// Baseline x86-64 compiler for hot functions.
+//
+
+#ifndef QI_JIT_H
+#define QI_JIT_H
+
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+#ifndef NAN_BOXING
+#error "The JIT works on NaN-boxed values."
+#endif
+
+// Calls plus loop back-edges a function runs before it gets compiled.
+#define JIT_THRESHOLD 1000
+
+typedef enum {
+    JIT_RETURNED,    // The function returned into its caller's frame.
+    JIT_FINISHED,    // The frame run() was started for returned, so run() must too.
+    JIT_ERROR,       // A runtime error has been reported.
+    JIT_TAIL_CALLED, // A tail call left the frame running another function.
+} JitResult;
+
+typedef struct JitCode {
+    uint8_t* code;
+    size_t size;
+    // Offset into code of the instruction at each bytecode offset, so a frame
+    // can move over from the interpreter wherever it happens to be.
+    int* offsets;
+} JitCode;
+
+void jitCompile(ObjFunction* function);
+JitResult jitRun(CallFrame* frame);
+void jitFree(ObjFunction* function);
+
+// Runtime helpers the generated code calls, defined in vm.c.
+bool jitExecute(CallFrame* frame, uint8_t* ip, OpCode instruction);
+JitResult jitReturn(CallFrame* frame);
+JitResult jitTailCall(CallFrame* frame, uint8_t* ip);
+bool jitResume();
+ObjClosure* jitConstruct(ObjClass* klass, int argCount);
+
+#endif //QI_JIT_H
@@ -3,17 +3,85 @@
 //
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
+#ifdef BASELINE_JIT
+#include "jit.h"
+#endif
+
+#ifdef PARALLEL_MARK
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+// Bytes of young objects that trigger a minor collection.
+#define NURSERY_SIZE (512 * 1024)
+// Lines at the start of each block taken up by its header.
+#define FIRST_LINE ((int)((sizeof(Block) + LINE_SIZE - 1) / LINE_SIZE))
+// Bytes the old generation can grow by between two steps of a major
+// collection.
+#define GC_STEP_SIZE (64 * 1024)
+// Objects a step marks or sweeps between looks at the clock.
+#define GC_STEP_WORK 64
+
+static void collectStep();
+static void sweepBlock(Block* block);
+
+// Cuts a new slab into cells for the given size class.
+static void newSlab(int sizeClass) {
+    Slab* slab = (Slab*)malloc(SLAB_SIZE);
+    if (slab == NULL) exit(1);
+    slab->next = vm.slabs;
+    vm.slabs = slab;
+
+    size_t cellSize = (size_t)(sizeClass + 1) * POOL_GRANULE;
+    char* cell = (char*)slab + POOL_GRANULE;
+    for (; cell + cellSize <= (char*)slab + SLAB_SIZE; cell += cellSize) {
+        ((PoolCell*)cell)->next = vm.pools[sizeClass];
+        vm.pools[sizeClass] = (PoolCell*)cell;
+    }
+}
+
+static void* allocateBytes(size_t size) {
+    if (size > POOL_MAX) {
+        void* result = malloc(size);
+        if (result == NULL) exit(1);
+        return result;
+    }
+
+    int sizeClass = (int)((size - 1) / POOL_GRANULE);
+    if (vm.pools[sizeClass] == NULL) newSlab(sizeClass);
+    PoolCell* cell = vm.pools[sizeClass];
+    vm.pools[sizeClass] = cell->next;
+    return cell;
+}
+
+// Callers pass the size they allocated, which picks the list a cell goes
+// back on.
+static void freeBytes(void* pointer, size_t size) {
+    if (pointer == NULL) return;
+    if (size > POOL_MAX) {
+        free(pointer);
+        return;
+    }
+
+    PoolCell* cell = (PoolCell*)pointer;
+    int sizeClass = (int)((size - 1) / POOL_GRANULE);
+    cell->next = vm.pools[sizeClass];
+    vm.pools[sizeClass] = cell;
+}
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
@@ -23,30 +91,245 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 #endif
 
         if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+            collectStep();
         }
     }
 
     if (newSize == 0) {
-        free(pointer);
+        freeBytes(pointer, oldSize);
         return NULL;
     }
 
-    void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
+    if (oldSize > POOL_MAX && newSize > POOL_MAX) {
+        void* result = realloc(pointer, newSize);
+        if (result == NULL) exit(1);
+        return result;
+    }
+
+    if (pointer != NULL && oldSize <= POOL_MAX && newSize <= POOL_MAX &&
+        (oldSize - 1) / POOL_GRANULE == (newSize - 1) / POOL_GRANULE) {
+        return pointer;
+    }
+
+    void* result = allocateBytes(newSize);
+    if (pointer != NULL) {
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        freeBytes(pointer, oldSize);
+    }
     return result;
 }
 
-void markObject(Obj* object) {
-    if (object == NULL) return;
-    if (object->isMarked) return;
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            return ALIGN_OBJECT(stringSize(string->length, string->width & ~STRING_MOVED));
+        }
+        case OBJ_CONCAT: return sizeof(ObjConcat);
+        case OBJ_BUILDER: return sizeof(ObjBuilder);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_LIST: return sizeof(ObjList);
+        case OBJ_MAP: return sizeof(ObjMap);
+        case OBJ_SHAPE: return sizeof(ObjShape);
+    }
+    return 0;
+}
 
-#ifdef DEBUG_LOG_GC
-    wprintf(L"%p mark ", (void*)object);
-    printValue(OBJ_VAL(object));
-    wprintf(L"\n");
+static void initBlock(Block* block, size_t size, bool large) {
+    block->unswept = false;
+    block->large = large;
+    block->size = size;
+    memset(block->lineCounts, 0, sizeof(block->lineCounts));
+    memset(block->markBits, 0, sizeof(block->markBits));
+    memset(block->oldBits, 0, sizeof(block->oldBits));
+}
+
+static void newBlock() {
+    Block* block = (Block*)aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+    if (block == NULL) exit(1);
+    initBlock(block, BLOCK_SIZE, false);
+    block->next = vm.blocks;
+    vm.blocks = block;
+
+    vm.allocCursor = (char*)block + FIRST_LINE * LINE_SIZE;
+    vm.allocLimit = (char*)block + BLOCK_SIZE;
+    vm.spanStart = vm.allocCursor;
+}
+
+static void addSpan(char* start, char* end) {
+    if (vm.youngSpanCapacity < vm.youngSpanCount + 1) {
+        vm.youngSpanCapacity = GROW_CAPACITY(vm.youngSpanCapacity);
+        vm.youngSpans = (YoungSpan*)realloc(vm.youngSpans, sizeof(YoungSpan) * vm.youngSpanCapacity);
+
+        if (vm.youngSpans == NULL) exit(1);
+    }
+
+    vm.youngSpans[vm.youngSpanCount].start = start;
+    vm.youngSpans[vm.youngSpanCount].end = end;
+    vm.youngSpanCount++;
+}
+
+// Records the young objects allocated in the current hole.
+static void closeSpan() {
+    if (vm.spanStart == vm.allocCursor) return;
+
+    addSpan(vm.spanStart, vm.allocCursor);
+    vm.spanStart = vm.allocCursor;
+}
+
+static Obj* largeObject(Block* block) {
+    return (Obj*)((char*)block + FIRST_LINE * LINE_SIZE);
+}
+
+// A large object is young in a span of its own. Its block is a spare one
+// if one is big enough, since freeing and allocating blocks anew would have
+// the system page them in again each time.
+static void* allocateLarge(size_t size) {
+    size_t blockSize = FIRST_LINE * LINE_SIZE + size;
+    blockSize = (blockSize + BLOCK_SIZE - 1) & ~(size_t)(BLOCK_SIZE - 1);
+
+    Block** link = &vm.spareBlocks;
+    while (*link != NULL && (*link)->size < blockSize) link = &(*link)->next;
+    Block* block = *link;
+    if (block != NULL) {
+        *link = block->next;
+        vm.spareBytes -= block->size;
+        blockSize = block->size;
+    } else {
+        block = (Block*)aligned_alloc(BLOCK_SIZE, blockSize);
+        if (block == NULL) exit(1);
+    }
+    initBlock(block, blockSize, true);
+    block->next = vm.largeBlocks;
+    vm.largeBlocks = block;
+
+    char* object = (char*)largeObject(block);
+    addSpan(object, object + size);
+    return object;
+}
+
+// Frees, or keeps as spares, the blocks of dead large objects. Called with
+// the nursery empty, when any object that isn't old is dead.
+static void releaseLarge() {
+    Block** link = &vm.largeBlocks;
+    while (*link != NULL) {
+        Block* block = *link;
+        size_t granule = granuleOf(largeObject(block));
+        if ((block->oldBits[granule / 64] >> (granule % 64)) & 1) {
+            link = &block->next;
+        } else {
+            *link = block->next;
+            if (vm.spareBytes + block->size <= NURSERY_SIZE) {
+                block->next = vm.spareBlocks;
+                vm.spareBlocks = block;
+                vm.spareBytes += block->size;
+            } else {
+                free(block);
+            }
+        }
+    }
+}
+
+// Moves the allocator on to the next run of free lines with room for size
+// bytes, or to a new block if the rest of the blocks have none. Blocks the
+// sweep has yet to reach are swept first, so their garbage frees up lines.
+static void nextHole(size_t size) {
+    closeSpan();
+
+    for (; vm.allocBlock != NULL; vm.allocBlock = vm.allocBlock->next, vm.allocLine = FIRST_LINE) {
+        Block* block = vm.allocBlock;
+        if (block->unswept) {
+            sweepBlock(block);
+            vm.lazySweeps++;
+        }
+
+        while (vm.allocLine < LINE_COUNT) {
+            int start = vm.allocLine;
+            while (start < LINE_COUNT && block->lineCounts[start] != 0) start++;
+            int end = start;
+            while (end < LINE_COUNT && block->lineCounts[end] == 0) end++;
+            vm.allocLine = end;
+
+            if ((size_t)(end - start) * LINE_SIZE >= size) {
+                vm.allocCursor = (char*)block + start * LINE_SIZE;
+                vm.allocLimit = (char*)block + end * LINE_SIZE;
+                vm.spanStart = vm.allocCursor;
+                return;
+            }
+        }
+    }
+
+    newBlock();
+}
+
+static void resetAllocator() {
+    vm.allocBlock = vm.blocks;
+    vm.allocLine = FIRST_LINE;
+    vm.allocCursor = NULL;
+    vm.allocLimit = NULL;
+    vm.spanStart = NULL;
+}
+
+void* allocateYoung(size_t size) {
+#ifdef DEBUG_STRESS_GC
+    collectYoung();
 #endif
-    object->isMarked = true;
+
+    size = ALIGN_OBJECT(size);
+    if (vm.youngBytes + size > NURSERY_SIZE) {
+        collectYoung();
+        if (vm.bytesAllocated > vm.nextGC) collectStep();
+    }
+
+    vm.youngBytes += size;
+    if (size >= LARGE_OBJECT_SIZE) return allocateLarge(size);
+
+    if ((size_t)(vm.allocLimit - vm.allocCursor) < size) nextHole(size);
+    void* result = vm.allocCursor;
+    vm.allocCursor += size;
+    return result;
+}
+
+// Gives back the object allocateYoung() last returned, as long as nothing
+// was allocated since.
+void unallocateYoung(void* pointer, size_t size) {
+    size = ALIGN_OBJECT(size);
+    if (size >= LARGE_OBJECT_SIZE || (char*)pointer + size != vm.allocCursor) return;
+    vm.allocCursor = pointer;
+    vm.youngBytes -= size;
+}
+
+void rememberObject(Obj* object) {
+    if (object->isYoung || object->isRemembered) return;
+
+    object->isRemembered = true;
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+static void setBit(uint64_t* bits, Obj* object) {
+    size_t granule = granuleOf(object);
+    bits[granule / 64] |= (uint64_t)1 << (granule % 64);
+}
+
+static void clearBit(uint64_t* bits, Obj* object) {
+    size_t granule = granuleOf(object);
+    bits[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+}
+
+static void pushGray(Obj* object) {
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
         vm.grayStack = (Obj**)realloc(vm.grayStack,sizeof(Obj*) * vm.grayCapacity);
@@ -57,6 +340,153 @@ void markObject(Obj* object) {
     vm.grayStack[vm.grayCount++] = object;
 }
 
+#ifdef PARALLEL_MARK
+// Marker threads each trace from a deque of gray objects of their own and
+// steal from the others' when it runs dry. A deque that fills up spills into
+// vm.grayStack, which markers also take work from.
+#define MARK_QUEUE_SIZE 4096
+// Gray objects a marker moves from vm.grayStack to its deque at a time.
+#define MARK_CHUNK 64
+
+// A Chase-Lev deque. The owner pushes and takes at the bottom, and other
+// markers steal from the top.
+typedef struct {
+    int64_t top;
+    int64_t bottom;
+    Obj* items[MARK_QUEUE_SIZE];
+} MarkQueue;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    // The last round of marking the thread has seen start.
+    uint64_t round;
+    MarkQueue queue;
+} Marker;
+
+static Marker* markers;
+// Markers with a thread started, counting the main thread as markers[0].
+static int markerCount;
+// markLock guards vm.grayStack while markers run, and the fields after it.
+static pthread_mutex_t markLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markDone = PTHREAD_COND_INITIALIZER;
+static uint64_t markRound;
+static int markActive;
+static int markFinished;
+static bool markExit;
+// Read and written by running markers.
+static int idleMarkers;
+static bool markStop;
+static uint64_t markDeadline;
+
+static _Thread_local Marker* currentMarker;
+
+static void pushMarkQueue(MarkQueue* queue, Obj* object) {
+    int64_t bottom = __atomic_load_n(&queue->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= MARK_QUEUE_SIZE) {
+        pthread_mutex_lock(&markLock);
+        pushGray(object);
+        pthread_mutex_unlock(&markLock);
+        return;
+    }
+
+    __atomic_store_n(&queue->items[bottom & (MARK_QUEUE_SIZE - 1)], object, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+static Obj* takeMarkQueue(MarkQueue* queue) {
+    int64_t bottom = __atomic_load_n(&queue->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&queue->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&queue->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Obj* object = __atomic_load_n(&queue->items[bottom & (MARK_QUEUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // The last item, which a thief may be after too.
+        if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            object = NULL;
+        }
+        __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
+}
+
+static Obj* stealMarkQueue(MarkQueue* queue) {
+    int64_t top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+
+    Obj* object = __atomic_load_n(&queue->items[top & (MARK_QUEUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return object;
+}
+
+// Sets the mark bit with an atomic or, so only the marker that flips it
+// pushes the object.
+static void markShared(Obj* object) {
+    uint64_t* word = &blockOf(object)->markBits[granuleOf(object) / 64];
+    uint64_t bit = (uint64_t)1 << (granuleOf(object) % 64);
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return;
+    if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) return;
+    pushMarkQueue(&currentMarker->queue, object);
+}
+#endif
+
+void shadeObject(Obj* object) {
+    if (vm.gcPhase == GC_MARK) markObject(object);
+}
+
+// The write barrier for an owner that had many references copied into it at
+// once: it is remembered if old, and scanned again if already marked.
+void rescanObject(Obj* object) {
+    rememberObject(object);
+    if (vm.gcPhase == GC_MARK && isMarked(object)) pushGray(object);
+}
+
+static void forgetRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+}
+
+void markObject(Obj* object) {
+    if (object == NULL) return;
+#ifdef PARALLEL_MARK
+    // Marker threads only ever trace the old generation.
+    if (currentMarker != NULL) {
+        if (!object->isYoung) markShared(object);
+        return;
+    }
+#endif
+    if (isMarked(object)) return;
+    // Old objects stay alive through a minor collection, and the young
+    // objects they point to are found through vm.remembered. A major
+    // collection leaves young objects to the minor one it ends with.
+    if (object->isYoung != vm.youngOnly) return;
+
+#ifdef DEBUG_LOG_GC
+    wprintf(L"%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    wprintf(L"\n");
+#endif
+    setBit(blockOf(object)->markBits, object);
+    pushGray(object);
+}
+
 void markValue(Value value) {
     if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
@@ -85,6 +515,8 @@ static void blackenObject(Obj* object) {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
+            markObject((Obj*)klass->rootShape);
+            markValue(klass->initializer);
             break;
         }
         case OBJ_CLOSURE: {
@@ -99,12 +531,32 @@ static void blackenObject(Obj* object) {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            // Keep cached shapes alive so a freed shape's address can never
+            // be reused by another shape and produce a false cache hit.
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                markObject((Obj*)cache->shape);
+                markObject((Obj*)cache->transition);
+                for (int j = 0; j < cache->methodCount; j++) {
+                    markObject(cache->methods[j].receiver);
+                    markValue(cache->methods[j].method);
+                }
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject((Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->slotCount; i++) {
+                markValue(instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
             break;
         }
         case OBJ_LIST: {
@@ -114,69 +566,125 @@ static void blackenObject(Obj* object) {
             }
             break;
         }
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*)object;
+            for (int i = 0; i < map->used; i++) {
+                markValue(map->entries[i].key);
+                markValue(map->entries[i].value);
+            }
+            break;
+        }
+        case OBJ_CONCAT: {
+            ObjConcat* concat = (ObjConcat*)object;
+            markObject((Obj*)concat->builder);
+            markObject((Obj*)concat->flat);
+            break;
+        }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
             break;
         case OBJ_NATIVE:
         case OBJ_STRING:
+        case OBJ_BUILDER:
             break;
     }
 }
 
-static void freeObject(Obj* object) {
+// Frees what an object owns. The object itself is reclaimed along with the
+// lines it sits in once nothing else is left in them.
+static void finalizeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
-    wprintf(L"%p free type %d\n", (void*)object, objType(object));
+    wprintf(L"%p free type %d\n", (void*)object, object->type);
 #endif
 
     switch (object->type) {
-        case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
-            break;
-        case OBJ_CLASS: {
-            ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+        case OBJ_CLASS:
+            freeTable(&((ObjClass*)object)->methods);
             break;
-        }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
+#ifdef BASELINE_JIT
+            jitFree(function);
+#endif
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
             break;
         }
-        case OBJ_NATIVE:
-            FREE(ObjNative, object);
-            break;
-        case OBJ_STRING: {
-            ObjString *string = (ObjString *) object;
-            FREE_ARRAY(wchar_t, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
             break;
         }
         case OBJ_LIST: {
             ObjList* list = (ObjList*)object;
-            FREE_ARRAY(Value*, list->items, list->count);
-            FREE(ObjList, object);
+            FREE_ARRAY(Value, list->items, list->capacity);
+            break;
+        }
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*)object;
+            reallocate(map->entries, mapSize(map->capacity), 0);
+            break;
+        }
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            if (string->width & STRING_MOVED) {
+                FREE_ARRAY(uint32_t, movedChars(string), string->length + 1);
+            }
             break;
         }
+        case OBJ_BUILDER: {
+            ObjBuilder* builder = (ObjBuilder*)object;
+            FREE_ARRAY(uint8_t, builder->chars, (size_t)builder->capacity * builder->width);
+            break;
+        }
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
+        case OBJ_CONCAT:
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
             break;
     }
 }
 
+// Adds delta to the count of every line the object overlaps.
+static void countLines(Obj* object, size_t size, int delta) {
+    Block* block = blockOf(object);
+    if (block->large) return;
+    size_t first = ((char*)object - (char*)block) / LINE_SIZE;
+    size_t last = ((char*)object + size - 1 - (char*)block) / LINE_SIZE;
+    for (size_t line = first; line <= last; line++) {
+        block->lineCounts[line] += delta;
+    }
+}
+
+// Survivors are promoted where they are. Interpreter and JIT code hold raw
+// object pointers in C locals and machine code, so objects never move.
+static void promote(Obj* object, size_t size) {
+    Block* block = blockOf(object);
+    object->isYoung = false;
+    setBit(block->oldBits, object);
+    vm.bytesAllocated += size;
+    countLines(object, size, 1);
+
+    // Promoted while a major collection marks, it still has to be scanned
+    // for the old objects it points to. Promoted into a block the sweep has
+    // yet to reach, it stays marked so the sweep keeps it.
+    if (vm.gcPhase == GC_MARK) {
+        pushGray(object);
+    } else if (vm.gcPhase != GC_SWEEP || !block->unswept) {
+        clearBit(block->markBits, object);
+    }
+}
+
 static void markRoots() {
     for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
         markValue(*slot);
@@ -190,67 +698,447 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalNames);
+    markArray(&vm.globalValues);
+    markTable(&vm.stringMethods);
+    markTable(&vm.listMethods);
+    markTable(&vm.mapMethods);
     markCompilerRoots();
     markObject((Obj*)vm.initString);
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
+// Walks every young object, promoting the marked ones and finalizing the
+// rest, which leaves the nursery empty.
+static void sweepYoung() {
+    closeSpan();
+    for (int i = 0; i < vm.youngSpanCount; i++) {
+        char* cursor = vm.youngSpans[i].start;
+        while (cursor < vm.youngSpans[i].end) {
+            Obj* object = (Obj*)cursor;
+            size_t size = objectSize(object);
+            cursor += size;
+
+            if (isMarked(object)) {
+                promote(object, size);
             } else {
-                vm.objects = object;
+                if (object->type == OBJ_STRING) {
+                    tableDelete(&vm.strings, (ObjString*)object);
+                }
+                finalizeObject(object);
             }
+        }
+    }
+
+    vm.youngSpanCount = 0;
+    vm.youngBytes = 0;
+    releaseLarge();
+}
+
+// Frees blocks nothing old is left in, keeping enough for a nursery.
+static void releaseBlocks() {
+    int kept = 0;
+    Block** link = &vm.blocks;
+    while (*link != NULL) {
+        Block* block = *link;
+        bool empty = true;
+        for (int i = FIRST_LINE; i < LINE_COUNT; i++) {
+            if (block->lineCounts[i] != 0) {
+                empty = false;
+                break;
+            }
+        }
+
+        if (empty && ++kept > NURSERY_SIZE / BLOCK_SIZE) {
+            *link = block->next;
+            free(block);
+        } else {
+            link = &block->next;
+        }
+    }
+}
+
+static uint64_t nanoTime() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+static void recordPause(uint64_t start) {
+    uint64_t pause = nanoTime() - start;
+    if (pause > vm.gcMaxPause) vm.gcMaxPause = pause;
+}
+
+#ifdef PARALLEL_MARK
+// Moves a chunk of vm.grayStack into the marker's deque, or failing that
+// steals an object from another marker.
+static Obj* findMarkWork(Marker* marker) {
+    pthread_mutex_lock(&markLock);
+    for (int i = 0; i < MARK_CHUNK && vm.grayCount > 0; i++) {
+        pushMarkQueue(&marker->queue, vm.grayStack[--vm.grayCount]);
+    }
+    pthread_mutex_unlock(&markLock);
+
+    Obj* object = takeMarkQueue(&marker->queue);
+    if (object != NULL) return object;
+
+    for (int i = 1; i < markActive; i++) {
+        Marker* victim = &markers[(marker->index + i) % markActive];
+        object = stealMarkQueue(&victim->queue);
+        if (object != NULL) return object;
+    }
+    return NULL;
+}
+
+static bool markWorkVisible() {
+    pthread_mutex_lock(&markLock);
+    bool spilled = vm.grayCount > 0;
+    pthread_mutex_unlock(&markLock);
+    if (spilled) return true;
+
+    for (int i = 0; i < markActive; i++) {
+        MarkQueue* queue = &markers[i].queue;
+        if (__atomic_load_n(&queue->top, __ATOMIC_ACQUIRE) <
+            __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Waits for another marker to have work to steal. Marking is done once every
+// marker is waiting, since only a busy marker can make more.
+static bool waitForMarkWork() {
+    __atomic_add_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+    while (true) {
+        if (__atomic_load_n(&idleMarkers, __ATOMIC_SEQ_CST) == markActive) return false;
+        if (__atomic_load_n(&markStop, __ATOMIC_RELAXED)) return false;
+        if (markWorkVisible()) {
+            __atomic_sub_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+            return true;
+        }
+        sched_yield();
+    }
+}
+
+static void runMarker(Marker* marker) {
+    currentMarker = marker;
+    int work = 0;
+    while (!__atomic_load_n(&markStop, __ATOMIC_RELAXED)) {
+        Obj* object = takeMarkQueue(&marker->queue);
+        if (object == NULL) object = findMarkWork(marker);
+        if (object == NULL) {
+            if (!waitForMarkWork()) break;
+            continue;
+        }
+
+        blackenObject(object);
+        if (++work % GC_STEP_WORK == 0 && nanoTime() > markDeadline) {
+            __atomic_store_n(&markStop, true, __ATOMIC_RELAXED);
+        }
+    }
+    currentMarker = NULL;
+}
 
-            freeObject(unreached);
+static void* markerThread(void* argument) {
+    Marker* marker = (Marker*)argument;
+    pthread_mutex_lock(&markLock);
+    while (true) {
+        while (markRound == marker->round && !markExit) pthread_cond_wait(&markStart, &markLock);
+        if (markExit) break;
+        marker->round = markRound;
+        if (marker->index >= markActive) continue;
+
+        pthread_mutex_unlock(&markLock);
+        runMarker(marker);
+        pthread_mutex_lock(&markLock);
+        markFinished++;
+        pthread_cond_signal(&markDone);
+    }
+    pthread_mutex_unlock(&markLock);
+    return NULL;
+}
+
+static void startMarkers(int count) {
+    if (markers == NULL) {
+        markers = (Marker*)calloc(MAX_MARK_THREADS, sizeof(Marker));
+        if (markers == NULL) exit(1);
+        markerCount = 1;
+    }
+
+    for (; markerCount < count; markerCount++) {
+        markers[markerCount].index = markerCount;
+        markers[markerCount].round = markRound;
+        if (pthread_create(&markers[markerCount].thread, NULL, markerThread, &markers[markerCount]) != 0) {
+            break;
         }
     }
 }
 
-static void traceReferences() {
-    while (vm.grayCount > 0) {
+// Traces the old generation with up to threads threads, the main one
+// included. Anything left when the deadline passes goes back on
+// vm.grayStack for the next step.
+static bool traceParallel(int threads, uint64_t deadline) {
+    startMarkers(threads);
+
+    pthread_mutex_lock(&markLock);
+    markActive = threads < markerCount ? threads : markerCount;
+    markFinished = 0;
+    idleMarkers = 0;
+    markStop = false;
+    markDeadline = deadline;
+    markRound++;
+    pthread_cond_broadcast(&markStart);
+    pthread_mutex_unlock(&markLock);
+
+    runMarker(&markers[0]);
+
+    pthread_mutex_lock(&markLock);
+    while (markFinished < markActive - 1) pthread_cond_wait(&markDone, &markLock);
+    pthread_mutex_unlock(&markLock);
+
+    for (int i = 0; i < markActive; i++) {
+        Obj* object;
+        while ((object = takeMarkQueue(&markers[i].queue)) != NULL) pushGray(object);
+    }
+    return vm.grayCount == 0;
+}
+
+// More markers than processors only take turns, so the count is capped.
+static int markThreadLimit() {
+    static long processors = 0;
+    if (processors == 0) processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors > 0 && vm.markThreads > processors) return (int)processors;
+    return vm.markThreads;
+}
+
+static void stopMarkers() {
+    pthread_mutex_lock(&markLock);
+    markExit = true;
+    pthread_cond_broadcast(&markStart);
+    pthread_mutex_unlock(&markLock);
+
+    for (int i = 1; i < markerCount; i++) pthread_join(markers[i].thread, NULL);
+    free(markers);
+    markers = NULL;
+    markerCount = 0;
+}
+#endif
+
+// Blackens gray objects until only base of them are left, or the deadline
+// passes. Returns whether it got down to base. Big enough heaps are traced
+// by several threads at once, where that's built in.
+static bool traceReferences(int base, uint64_t deadline) {
+#ifdef PARALLEL_MARK
+    if (!vm.youngOnly && vm.bytesAllocated > PARALLEL_MARK_THRESHOLD) {
+        int threads = markThreadLimit();
+        if (threads > 1) return traceParallel(threads, deadline);
+    }
+#endif
+
+    int work = 0;
+    while (vm.grayCount > base) {
         Obj* object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
+        if (++work % GC_STEP_WORK == 0 && nanoTime() > deadline) break;
     }
+    return vm.grayCount == base;
 }
 
-void collectGarbage() {
+// Roots and remembered old objects are traced as far as the young objects
+// they reach, and survivors are promoted. Gray objects a major collection
+// left on the stack sit below the ones this pushes.
+static void minorCollection() {
+#ifdef DEBUG_LOG_GC
+    wprintf(L"-- minor gc begin\n");
+    size_t before = vm.youngBytes;
+#endif
+
+    int base = vm.grayCount;
+    vm.youngOnly = true;
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.remembered[i]);
+    }
+    traceReferences(base, UINT64_MAX);
+    vm.youngOnly = false;
+    sweepYoung();
+    forgetRemembered();
+    resetAllocator();
+
+#ifdef DEBUG_LOG_GC
+    wprintf(L"-- minor gc end\n");
+    wprintf(L"   nursery held %zu bytes, old generation now %zu\n", before, vm.bytesAllocated);
+#endif
+}
+
+void collectYoung() {
+    uint64_t start = nanoTime();
+    minorCollection();
+    recordPause(start);
+}
+
+static void startMark() {
 #ifdef DEBUG_LOG_GC
     wprintf(L"-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
 
+    vm.gcPhase = GC_MARK;
     markRoots();
-    traceReferences();
+}
+
+// Marking is done once the gray stack runs dry. The roots have changed since
+// startMark(), and young objects may point to unmarked old ones, so this
+// promotes the nursery and rescans the roots before draining it once more.
+static bool finishMark(uint64_t deadline) {
+    if (!traceReferences(0, deadline)) return false;
+
+    minorCollection();
+    markRoots();
+    traceReferences(0, UINT64_MAX);
     tableRemoveWhite(&vm.strings);
-    sweep();
 
+    vm.gcPhase = GC_SWEEP;
+    for (Block* block = vm.blocks; block != NULL; block = block->next) {
+        block->unswept = true;
+    }
+    vm.sweepBlock = vm.blocks;
+    // Large objects are few enough to sweep all at once.
+    for (Block* block = vm.largeBlocks; block != NULL; block = block->next) {
+        sweepBlock(block);
+    }
+    releaseLarge();
+    return true;
+}
+
+// Frees the old objects in a block that aren't marked and clears the marks
+// of the rest.
+static void sweepBlock(Block* block) {
+    for (int i = 0; i < BITMAP_WORDS; i++) {
+        uint64_t dead = block->oldBits[i] & ~block->markBits[i];
+        while (dead != 0) {
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+
+            Obj* object = (Obj*)((char*)block + ((size_t)i * 64 + bit) * GRANULE_SIZE);
+            size_t size = objectSize(object);
+            vm.bytesAllocated -= size;
+            countLines(object, size, -1);
+            finalizeObject(object);
+        }
+
+        block->oldBits[i] &= block->markBits[i];
+        block->markBits[i] = 0;
+    }
+    block->unswept = false;
+}
+
+// Sweeps the blocks the allocator hasn't, a block at a time. Blocks added
+// since marking finished are at the head of vm.blocks, ahead of where the
+// sweep started, so it never sees them.
+static void sweep(uint64_t deadline) {
+    while (vm.sweepBlock != NULL) {
+        Block* block = vm.sweepBlock;
+        vm.sweepBlock = block->next;
+        if (!block->unswept) continue;
+
+        sweepBlock(block);
+        vm.eagerSweeps++;
+        if (nanoTime() > deadline) return;
+    }
+
+    // Young objects don't count towards their lines, so only an empty
+    // nursery makes it safe to free blocks.
+    vm.gcPhase = GC_IDLE;
+    minorCollection();
+    releaseBlocks();
+    resetAllocator();
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
     wprintf(L"-- gc end\n");
-    wprintf(L"   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+    wprintf(L"   old generation now %zu bytes, next at %zu\n", vm.bytesAllocated, vm.nextGC);
+    wprintf(L"   %zu blocks swept eagerly, %zu lazily so far\n", vm.eagerSweeps, vm.lazySweeps);
 #endif
 }
 
+// Works on the major collection in progress, starting one if there is none.
+// A step never goes on from marking to sweeping, so the allocator gets the
+// chance to sweep the blocks it needs first.
+static void collectStep() {
+    uint64_t start = nanoTime();
+    uint64_t deadline = vm.gcPauseBudget == 0 ? UINT64_MAX : start + vm.gcPauseBudget;
+    if (vm.gcPhase == GC_SWEEP) {
+        sweep(deadline);
+    } else {
+        if (vm.gcPhase == GC_IDLE) startMark();
+        finishMark(deadline);
+    }
+
+    if (vm.gcPhase != GC_IDLE) vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+    recordPause(start);
+}
+
+// Finishes any major collection in progress, then marks the whole heap anew.
+// Sweeping is left to the allocator and later steps.
+void collectGarbage() {
+    uint64_t start = nanoTime();
+    if (vm.gcPhase == GC_MARK) finishMark(UINT64_MAX);
+    if (vm.gcPhase == GC_SWEEP) sweep(UINT64_MAX);
+    startMark();
+    finishMark(UINT64_MAX);
+    vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+    recordPause(start);
+}
+
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    // With every mark cleared, sweeping a block frees all its old objects.
+    for (Block* block = vm.blocks; block != NULL; block = block->next) {
+        memset(block->markBits, 0, sizeof(block->markBits));
+        sweepBlock(block);
+    }
+    for (Block* block = vm.largeBlocks; block != NULL; block = block->next) {
+        memset(block->markBits, 0, sizeof(block->markBits));
+        sweepBlock(block);
     }
 
+    closeSpan();
+    for (int i = 0; i < vm.youngSpanCount; i++) {
+        char* cursor = vm.youngSpans[i].start;
+        while (cursor < vm.youngSpans[i].end) {
+            Obj* object = (Obj*)cursor;
+            cursor += objectSize(object);
+            finalizeObject(object);
+        }
+    }
+
+    Block* block = vm.blocks;
+    while (block != NULL) {
+        Block* next = block->next;
+        free(block);
+        block = next;
+    }
+    // Sweeping cleared the old bits of every large block.
+    releaseLarge();
+    block = vm.spareBlocks;
+    while (block != NULL) {
+        Block* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    Slab* slab = vm.slabs;
+    while (slab != NULL) {
+        Slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+#ifdef PARALLEL_MARK
+    if (markers != NULL) stopMarkers();
+#endif
+
     free(vm.grayStack);
+    free(vm.youngSpans);
+    free(vm.remembered);
 }
@@ -23,10 +23,104 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Objects are bump-allocated into blocks of BLOCK_SIZE bytes split into
+// lines. Each line counts the old objects overlapping it, and new objects go
+// into the holes between lines in use. Blocks are aligned to their size, so
+// an object's block is its address with the low bits cleared.
+#define BLOCK_SIZE (32 * 1024)
+#define LINE_SIZE 128
+#define LINE_COUNT (BLOCK_SIZE / LINE_SIZE)
+// Each block keeps a bitmap of which objects are marked and one of where old
+// objects start, with a bit for every GRANULE_SIZE bytes. Marking never
+// writes to the objects themselves, and sweeping a block scans its bitmaps.
+#define GRANULE_SIZE 8
+#define BITMAP_WORDS (BLOCK_SIZE / GRANULE_SIZE / 64)
+// Objects of at least LARGE_OBJECT_SIZE bytes, like long strings, each get a
+// block of their own, made as big as the object needs.
+#define LARGE_OBJECT_SIZE (BLOCK_SIZE / 4)
+
+#define ALIGN_OBJECT(size) \
+    (((size) + GRANULE_SIZE - 1) & ~(size_t)(GRANULE_SIZE - 1))
+
+typedef struct Block {
+    struct Block* next;
+    // Whether the sweep of the current major collection has yet to get here.
+    bool unswept;
+    // Whether the block holds a single large object, which its lines don't
+    // count, and the bytes it spans, which can be more than BLOCK_SIZE.
+    bool large;
+    size_t size;
+    uint8_t lineCounts[LINE_COUNT];
+    uint64_t markBits[BITMAP_WORDS];
+    uint64_t oldBits[BITMAP_WORDS];
+} Block;
+
+static inline Block* blockOf(Obj* object) {
+    return (Block*)((uintptr_t)object & ~(uintptr_t)(BLOCK_SIZE - 1));
+}
+
+static inline size_t granuleOf(Obj* object) {
+    return ((uintptr_t)object & (BLOCK_SIZE - 1)) / GRANULE_SIZE;
+}
+
+static inline bool isMarked(Obj* object) {
+    size_t granule = granuleOf(object);
+    return (blockOf(object)->markBits[granule / 64] >> (granule % 64)) & 1;
+}
+
+// Arrays of up to POOL_MAX bytes, like string characters and instance
+// fields, come from free lists of cells rounded up to POOL_GRANULE bytes.
+// Each list is refilled a SLAB_SIZE slab at a time, and freeing a cell just
+// pushes it back on its list.
+#define POOL_GRANULE 16
+#define POOL_MAX 256
+#define POOL_CLASSES (POOL_MAX / POOL_GRANULE)
+#define SLAB_SIZE (16 * 1024)
+
+typedef struct PoolCell {
+    struct PoolCell* next;
+} PoolCell;
+
+typedef struct Slab {
+    struct Slab* next;
+} Slab;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} GcPhase;
+
+// A run of young objects allocated back to back.
+typedef struct {
+    char* start;
+    char* end;
+} YoungSpan;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateYoung(size_t size);
+void unallocateYoung(void* pointer, size_t size);
+void rememberObject(Obj* object);
+void shadeObject(Obj* object);
+void rescanObject(Obj* object);
 void markObject(Obj* object);
 void markValue(Value value);
+void collectYoung();
 void collectGarbage();
 void freeObjects();
 
+// Call after storing value into owner. Minor collections only trace young
+// objects, so an old object that points to a young one has to be remembered.
+// While a major collection marks incrementally, a marked object must not be
+// left pointing to an unmarked one, so the value is shaded gray.
+static inline void writeBarrier(Obj* owner, Value value) {
+    if (!IS_OBJ(value)) return;
+    Obj* object = AS_OBJ(value);
+    if (object->isYoung) {
+        if (!owner->isYoung) rememberObject(owner);
+    } else if (isMarked(owner) && !isMarked(object)) {
+        shadeObject(object);
+    }
+}
+
 #endif //QI_MEMORY_H
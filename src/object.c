@@ -15,11 +15,10 @@
     (type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = (Obj*)allocateYoung(size);
     object->type = type;
-    object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isYoung = true;
+    object->isRemembered = false;
 
 #ifdef DEBUG_LOG_GC
     wprintf(L"%p allocate %zu for %d\n", (void*)object, size, type);
@@ -32,12 +31,14 @@ ObjBoundMethod* newBoundMethod(Value reciever, ObjClosure* method) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = reciever;
     bound->method = method;
+    bound->native = NULL;
     return bound;
 }
 
 ObjBoundMethod* newBoundNative(Value reciever, ObjNative* native) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = reciever;
+    bound->method = NULL;
     bound->native = native;
     return bound;
 }
@@ -45,7 +46,16 @@ ObjBoundMethod* newBoundNative(Value reciever, ObjNative* native) {
 ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
+    klass->rootShape = NULL;
+    klass->fieldCapacity = 0;
+    klass->initializer = NIL_VAL;
+    klass->methodEpoch = 0;
     initTable(&klass->methods);
+
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape();
+    writeBarrier(&klass->obj, OBJ_VAL(klass->rootShape));
+    pop();
     return klass;
 }
 
@@ -67,18 +77,63 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+#ifdef BASELINE_JIT
+    function->hotness = 0;
+    function->jit = NULL;
+#endif
     initChunk(&function->chunk);
     return function;
 }
 
 ObjInstance* newInstance(ObjClass* klass, bool isStatic) {
+    // Start with room for as many fields as earlier instances of the class
+    // ended up with, so constructors rarely have to grow the array.
+    Value* fields = ALLOCATE(Value, klass->fieldCapacity);
+
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
+    instance->shape = klass->rootShape;
+    instance->fields = fields;
+    instance->fieldCapacity = klass->fieldCapacity;
     instance->isStatic = isStatic;
-    initTable(&instance->fields);
     return instance;
 }
 
+bool getInstanceField(ObjInstance* instance, ObjString* name, Value* value) {
+    int slot = findShapeSlot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+void setInstanceField(ObjInstance* instance, ObjString* name, Value value) {
+    int slot = findShapeSlot(instance->shape, name);
+    if (slot != -1) {
+        instance->fields[slot] = value;
+        writeBarrier(&instance->obj, value);
+        return;
+    }
+
+    addInstanceField(instance, shapeTransition(instance->shape, name), value);
+}
+
+void addInstanceField(ObjInstance* instance, ObjShape* shape, Value value) {
+    if (instance->fieldCapacity < shape->slotCount) {
+        int oldCapacity = instance->fieldCapacity;
+        instance->fieldCapacity = GROW_CAPACITY(oldCapacity);
+        instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, instance->fieldCapacity);
+    }
+
+    instance->fields[shape->slotCount - 1] = value;
+    instance->shape = shape;
+    writeBarrier(&instance->obj, value);
+    writeBarrier(&instance->obj, OBJ_VAL(shape));
+
+    ObjClass* klass = instance->klass;
+    if (klass->fieldCapacity < shape->slotCount) klass->fieldCapacity = shape->slotCount;
+}
+
 ObjNative* newNative(NativeFn function, int arity) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
@@ -86,105 +141,493 @@ ObjNative* newNative(NativeFn function, int arity) {
     return native;
 }
 
-static ObjString* allocateString(wchar_t* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+ObjShape* newShape() {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->slotCount = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    return shape;
+}
 
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
+int findShapeSlot(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    ObjShape* child = newShape();
+    push(OBJ_VAL(child));
+    tableAddAll(&shape->slots, &child->slots);
+    rescanObject(&child->obj);
+    tableSet(&child->slots, name, NUMBER_VAL(shape->slotCount));
+    writeBarrier(&child->obj, OBJ_VAL(name));
+    child->slotCount = shape->slotCount + 1;
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    writeBarrier(&shape->obj, OBJ_VAL(child));
     pop();
+    return child;
+}
 
-    return string;
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Multiplies two words and folds the high half of the product into the low.
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t aHi = a >> 32, aLo = (uint32_t)a, bHi = b >> 32, bLo = (uint32_t)b;
+    uint64_t hiHi = aHi * bHi, hiLo = aHi * bLo, loHi = aLo * bHi, loLo = aLo * bLo;
+    uint64_t middle = (loLo >> 32) + (uint32_t)hiLo + (uint32_t)loHi;
+    uint64_t lo = (middle << 32) | (uint32_t)loLo;
+    uint64_t hi = hiHi + (hiLo >> 32) + (loHi >> 32) + (middle >> 32);
+    return lo ^ hi;
+#endif
 }
 
-static uint32_t hashString(const wchar_t* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; ++i) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+// Hashes every byte of a string's characters a word at a time, after
+// wyhash. Interned strings are always at their narrowest width, so equal
+// strings have the same bytes.
+static uint32_t hashChars(const uint8_t* chars, int length, int width) {
+    static const uint64_t secret[4] = {
+        0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+    };
+    const uint8_t* p = chars;
+    size_t size = (size_t)length * width;
+    uint64_t seed = secret[0] ^ mix(secret[0] ^ secret[1], secret[1]);
+    uint64_t a, b;
+
+    if (size <= 16) {
+        if (size >= 4) {
+            size_t middle = (size >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + size - 4) << 32) | read32(p + size - 4 - middle);
+        } else if (size > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = size;
+        if (left > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                seed1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (left > 16) {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = read64(p + left - 16);
+        b = read64(p + left - 8);
+    }
+
+    return (uint32_t)mix(secret[1] ^ size, mix(a ^ secret[1], b ^ seed));
+}
+
+static void putChar(ObjString* string, int index, wchar_t c) {
+    switch (string->width) {
+        case 1: string->chars[index] = (uint8_t)c; break;
+        case 2: ((uint16_t*)string->chars)[index] = (uint16_t)c; break;
+        case 4: ((uint32_t*)string->chars)[index] = (uint32_t)c; break;
+        default: movedChars(string)[index] = (uint32_t)c; break;
     }
-    return hash;
 }
 
-ObjString* takeString(wchar_t* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+// The width of the widest character from start to end, stopping early at
+// the string's own.
+static int widthOfChars(ObjString* string, int start, int end) {
+    int width = 1;
+    for (int i = start; i < end && width < string->width; i++) {
+        int charW = charWidth(charAt(string, i));
+        if (charW > width) width = charW;
+    }
+    return width;
+}
+
+// Interns a string already at its narrowest width.
+static ObjString* addString(ObjString* string) {
+    string->hash = hashChars(string->chars, string->length, string->width);
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length,
+                                          string->width, string->hash);
     if (interned != NULL) {
-        FREE_ARRAY(wchar_t, chars, length + 1);
+        unallocateYoung(string, stringSize(string->length, string->width));
         return interned;
     }
-    return allocateString(chars, length, hash);
+
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+    return string;
+}
+
+// The caller fills in the characters and passes the string to
+// internString(), allocating nothing in between.
+ObjString* allocateString(int length, int width) {
+    ObjString* string = (ObjString*)allocateObject(stringSize(length, width), OBJ_STRING);
+    string->width = width;
+    string->length = length;
+    string->hash = 0;
+    putChar(string, length, L'\0');
+    return string;
+}
+
+// Returns the string already interned with the same characters, giving the
+// new one back, or interns the new one. A string wider than its characters
+// need is copied to a narrower one first.
+ObjString* internString(ObjString* string) {
+    int width = widthOfChars(string, 0, string->length);
+    if (width < string->width) {
+        push(OBJ_VAL(string));
+        ObjString* narrow = allocateString(string->length, width);
+        pop();
+        copyChars(narrow, 0, string, 0, string->length);
+        string = narrow;
+    }
+    return addString(string);
 }
 
+// How long a string copyString() looks up before allocating can be.
+#define SHORT_STRING 16
+
 ObjString* copyString(const wchar_t* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
-    wchar_t* heapChars = ALLOCATE(wchar_t, length + 1);
-    memcpy(heapChars, chars, length * sizeof(wchar_t));
-    heapChars[length] = L'\0';
-    return allocateString(heapChars, length, hash);
-}
-
-ObjString* handleEscapeSequences(ObjString* string) {
-    wchar_t *here = string->chars;
-    size_t len = string->length;
-    int num;
-    int num_len;
-
-    while (NULL != (here = wcschr(here, L'·'))) {
-        num_len = 1;
-        switch (here[1]) {
-            case L'r':
-                *here = L'\r';
-                break;
-            case L'b':
-                *here = L'\b';
-                break;
-            case L'f':
-                *here = L'\f';
-                break;
-            case L'n':
-                *here = L'\n';
-                break;
-            case L't':
-                *here = L'\t';
-                break;
-            case L'v':
-                *here = L'\v';
-                break;
-            case L'a':
-                *here = L'\a';
-                break;
+    int width = 1;
+    for (int i = 0; i < length; i++) {
+        if (charWidth(chars[i]) > width) width = charWidth(chars[i]);
+    }
+
+    // Short strings, like the characters indexing makes, are usually
+    // interned already, so look them up before allocating.
+    if (length <= SHORT_STRING) {
+        uint32_t narrow[SHORT_STRING];
+        for (int i = 0; i < length; i++) {
+            switch (width) {
+                case 1: ((uint8_t*)narrow)[i] = (uint8_t)chars[i]; break;
+                case 2: ((uint16_t*)narrow)[i] = (uint16_t)chars[i]; break;
+                default: narrow[i] = (uint32_t)chars[i]; break;
+            }
+        }
+        uint32_t hash = hashChars((uint8_t*)narrow, length, width);
+        ObjString* interned = tableFindString(&vm.strings, (uint8_t*)narrow, length, width, hash);
+        if (interned != NULL) return interned;
+    }
+
+    ObjString* string = allocateString(length, width);
+    for (int i = 0; i < length; i++) {
+        putChar(string, i, chars[i]);
+    }
+    return addString(string);
+}
+
+ObjString* sliceString(ObjString* string, int start, int end) {
+    int width = widthOfChars(string, start, end);
+    if (width == string->width) {
+        const uint8_t* chars = string->chars + (size_t)start * width;
+        uint32_t hash = hashChars(chars, end - start, width);
+        ObjString* interned = tableFindString(&vm.strings, chars, end - start, width, hash);
+        if (interned != NULL) return interned;
+    }
+
+    ObjString* slice = allocateString(end - start, width);
+    copyChars(slice, 0, string, start, end - start);
+    return addString(slice);
+}
+
+// Copies count characters from start in one string to index in another,
+// which has to be wide enough for them.
+void copyChars(ObjString* to, int index, ObjString* from, int start, int count) {
+    if (to->width == from->width) {
+        memcpy(to->chars + (size_t)index * to->width,
+               from->chars + (size_t)start * from->width, (size_t)count * from->width);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        putChar(to, index + i, charAt(from, start + i));
+    }
+}
+
+static uint32_t readChar(const uint8_t* chars, int width, int index) {
+    switch (width) {
+        case 1: return chars[index];
+        case 2: return ((const uint16_t*)chars)[index];
+        default: return ((const uint32_t*)chars)[index];
+    }
+}
+
+static void writeChar(uint8_t* chars, int width, int index, uint32_t c) {
+    switch (width) {
+        case 1: chars[index] = (uint8_t)c; break;
+        case 2: ((uint16_t*)chars)[index] = (uint16_t)c; break;
+        default: ((uint32_t*)chars)[index] = c; break;
+    }
+}
+
+// from is NULL when a new builder first grows, with count 0.
+static void convertChars(uint8_t* to, int toWidth, const uint8_t* from, int fromWidth, int count) {
+    if (count == 0) return;
+    if (toWidth == fromWidth) {
+        memcpy(to, from, (size_t)count * toWidth);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        writeChar(to, toWidth, i, readChar(from, fromWidth, i));
+    }
+}
+
+static ObjBuilder* newBuilder() {
+    ObjBuilder* builder = ALLOCATE_OBJ(ObjBuilder, OBJ_BUILDER);
+    builder->width = 1;
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->chars = NULL;
+    return builder;
+}
+
+// Makes room in a reachable builder for count more characters of width.
+// Every concatenation in it keeps its characters, just wider if need be.
+static void reserveBuilder(ObjBuilder* builder, int count, int width) {
+    int needed = builder->length + count;
+    if (needed <= builder->capacity && width <= builder->width) return;
+
+    int capacity = builder->capacity;
+    while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+    if (width < builder->width) width = builder->width;
+
+    uint8_t* chars = ALLOCATE(uint8_t, (size_t)capacity * width);
+    convertChars(chars, width, builder->chars, builder->width, builder->length);
+    FREE_ARRAY(uint8_t, builder->chars, (size_t)builder->capacity * builder->width);
+    builder->chars = chars;
+    builder->capacity = capacity;
+    builder->width = width;
+}
+
+// Adds a string, which may be a concatenation, to the end of a builder.
+// Both have to be reachable.
+static void appendToBuilder(ObjBuilder* builder, Value value) {
+    int length = stringLength(value);
+    ObjConcat* concat = IS_CONCAT(value) && AS_CONCAT(value)->flat == NULL ? AS_CONCAT(value) : NULL;
+    ObjString* string = concat == NULL ? flattenString(value) : NULL;
+    reserveBuilder(builder, length, concat != NULL ? concat->builder->width : stringWidth(string));
+
+    // Only look at the characters once the builder has grown, since they
+    // may be its own.
+    uint8_t* to = builder->chars + (size_t)builder->length * builder->width;
+    if (concat != NULL) {
+        convertChars(to, builder->width, concat->builder->chars, concat->builder->width, length);
+    } else {
+        const uint8_t* from = string->width & STRING_MOVED ? (uint8_t*)movedChars(string) : string->chars;
+        convertChars(to, builder->width, from, stringWidth(string), length);
+    }
+    builder->length += length;
+}
+
+// Returns a + b. Both have to be reachable, since this can collect.
+Value concatenateStrings(Value a, Value b) {
+    int length = stringLength(a) + stringLength(b);
+    if (length < CONCAT_MIN) {
+        // Concatenations are never this short, so a and b are strings.
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int width = stringWidth(left) > stringWidth(right) ? stringWidth(left) : stringWidth(right);
+        ObjString* result = allocateString(length, width);
+        copyChars(result, 0, left, 0, left->length);
+        copyChars(result, left->length, right, 0, right->length);
+        return OBJ_VAL(internString(result));
+    }
+
+    // When a is the newest concatenation in its builder, b can go straight
+    // after it. Otherwise a is copied into a builder of its own first.
+    ObjBuilder* builder;
+    if (IS_CONCAT(a) && AS_CONCAT(a)->flat == NULL &&
+        AS_CONCAT(a)->builder->length == AS_CONCAT(a)->length) {
+        builder = AS_CONCAT(a)->builder;
+        push(OBJ_VAL(builder));
+    } else {
+        builder = newBuilder();
+        push(OBJ_VAL(builder));
+        appendToBuilder(builder, a);
+    }
+    appendToBuilder(builder, b);
+
+    ObjConcat* concat = ALLOCATE_OBJ(ObjConcat, OBJ_CONCAT);
+    concat->length = length;
+    concat->builder = builder;
+    concat->flat = NULL;
+    pop();
+    return OBJ_VAL(concat);
+}
+
+ObjString* flattenConcat(ObjConcat* concat) {
+    if (concat->flat != NULL) return concat->flat;
+
+    push(OBJ_VAL(concat));
+    ObjBuilder* builder = concat->builder;
+    ObjString* string = allocateString(concat->length, builder->width);
+    memcpy(string->chars, builder->chars, (size_t)concat->length * builder->width);
+    string = internString(string);
+    pop();
+
+    // The builder is only needed for the characters, which string has now.
+    concat->flat = string;
+    concat->builder = NULL;
+    writeBarrier(&concat->obj, OBJ_VAL(string));
+    return string;
+}
+
+// Whether two values, one of them a concatenation, are the same string.
+bool concatEqual(Value a, Value b) {
+    if (!IS_STRING(a) || !IS_STRING(b) || stringLength(a) != stringLength(b)) return false;
+    push(a);
+    push(b);
+    bool equal = flattenString(a) == flattenString(b);
+    pop();
+    pop();
+    return equal;
+}
+
+// Returns the characters of a string as a null-terminated array of
+// wchar_t, to be freed with freeWideString().
+wchar_t* wideString(ObjString* string) {
+    wchar_t* chars = ALLOCATE(wchar_t, string->length + 1);
+    for (int i = 0; i < string->length; i++) {
+        chars[i] = charAt(string, i);
+    }
+    chars[string->length] = L'\0';
+    return chars;
+}
+
+void freeWideString(ObjString* string, wchar_t* chars) {
+    FREE_ARRAY(wchar_t, chars, string->length + 1);
+}
+
+// Returns the index of the first match of search from start on, or -1.
+int findString(ObjString* string, ObjString* search, int start) {
+    int last = string->length - search->length;
+    if (search->length == 0) return start <= string->length ? start : -1;
+
+    if (string->width == search->width && !(string->width & STRING_MOVED)) {
+        size_t width = string->width;
+        wchar_t first = charAt(search, 0);
+        for (int i = start; i <= last; i++) {
+            if (charAt(string, i) == first &&
+                memcmp(string->chars + i * width, search->chars, search->length * width) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    for (int i = start; i <= last; i++) {
+        int j = 0;
+        while (j < search->length && charAt(string, i + j) == charAt(search, j)) j++;
+        if (j == search->length) return i;
+    }
+    return -1;
+}
+
+int compareStrings(ObjString* a, ObjString* b) {
+    int length = a->length < b->length ? a->length : b->length;
+    for (int i = 0; i < length; i++) {
+        wchar_t charA = charAt(a, i);
+        wchar_t charB = charAt(b, i);
+        if (charA != charB) return charA < charB ? -1 : 1;
+    }
+    return a->length - b->length;
+}
+
+void writeString(FILE* file, ObjString* string) {
+    wchar_t buffer[256];
+    int i = 0;
+    while (i < string->length) {
+        int count = 0;
+        while (count < 255 && i < string->length) buffer[count++] = charAt(string, i++);
+        buffer[count] = L'\0';
+        fwprintf(file, L"%ls", buffer);
+    }
+}
+
+// Makes the string a literal stands for, with each escape sequence replaced
+// by the character it escapes.
+ObjString* handleEscapeSequences(const wchar_t* chars, int length) {
+    wchar_t* result = ALLOCATE(wchar_t, length + 1);
+    int count = 0;
+    for (int i = 0; i < length; i++) {
+        if (chars[i] != L'·' || i + 1 == length) {
+            result[count++] = chars[i];
+            continue;
+        }
+
+        int num = 0;
+        int skip = 1;
+        switch (chars[i + 1]) {
+            case L'r': result[count++] = L'\r'; break;
+            case L'b': result[count++] = L'\b'; break;
+            case L'f': result[count++] = L'\f'; break;
+            case L'n': result[count++] = L'\n'; break;
+            case L't': result[count++] = L'\t'; break;
+            case L'v': result[count++] = L'\v'; break;
+            case L'a': result[count++] = L'\a'; break;
             case L'u':
-                swscanf(here + 2, L"%4x", &num);
-                num_len = 5;
-                *here = (wchar_t)num;
+                swscanf(chars + i + 2, L"%4x", &num);
+                skip = 5;
+                result[count++] = (wchar_t)num;
                 break;
             case L'U':
-                swscanf(here + 2, L"%8x", &num);
-                num_len = 9;
-                *here = (wchar_t)num;
+                swscanf(chars + i + 2, L"%8x", &num);
+                skip = 9;
+                result[count++] = (wchar_t)num;
                 break;
             default:
-                *here = here[1];
+                result[count++] = chars[i + 1];
                 break;
         }
-        num = here - string->chars + num_len;
-        here++;
-        wmemmove(here, here + num_len, len - num);
+        i += skip < length - i ? skip : length - i - 1;
     }
+
+    ObjString* string = copyString(result, count);
+    FREE_ARRAY(wchar_t, result, length + 1);
     return string;
 }
 
+// A character too wide for the string moves all of them out to an array of
+// four-byte ones.
 void storeToString(ObjString* string, int index, wchar_t value) {
-    string->chars[index] = value;
+    if (!(string->width & STRING_MOVED) && charWidth(value) > string->width) {
+        uint32_t* chars = ALLOCATE(uint32_t, string->length + 1);
+        for (int i = 0; i <= string->length; i++) {
+            chars[i] = charAt(string, i);
+        }
+        memcpy(string->chars, &chars, sizeof(chars));
+        string->width |= STRING_MOVED;
+    }
+    putChar(string, index, value);
 }
 
 wchar_t indexFromString(ObjString* string, int index) {
-    return string->chars[index];
+    return charAt(string, index);
 }
 
 bool isValidStringIndex(ObjString* string, int index) {
@@ -207,7 +650,9 @@ static void printfunction(ObjFunction* function) {
         wprintf(L"《脚本》");
         return;
     }
-    wprintf(L"《功能 %ls》", function->name->chars);
+    wprintf(L"《功能 ");
+    writeString(stdout, function->name);
+    wprintf(L"》");
 }
 
 static void printList(ObjList* list) {
@@ -221,6 +666,26 @@ static void printList(ObjList* list) {
     wprintf(L"】");
 }
 
+static void printMap(ObjMap* map) {
+    if (map->count == 0) {
+        wprintf(L"【：】");
+        return;
+    }
+    wprintf(L"【");
+    int printed = 0;
+    for (int i = 0; i < map->used; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
+        printValue(entry->key);
+        wprintf(L"：");
+        printValue(entry->value);
+        if (++printed < map->count) {
+            wprintf(L"，");
+        }
+    }
+    wprintf(L"】");
+}
+
 ObjList* newList() {
     ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
     list->items = NULL;
@@ -241,10 +706,12 @@ void insertToList(ObjList* list, Value value, int index) {
     }
     list->items[index] = value;
     list->count++;
+    writeBarrier(&list->obj, value);
 }
 
 void storeToList(ObjList* list, int index, Value value) {
     list->items[index] = value;
+    writeBarrier(&list->obj, value);
 }
 
 Value indexFromList(ObjList* list, int index) {
@@ -277,7 +744,7 @@ static int partitionList(ObjList* list, int low, int high, ObjClosure* pred) {
             } else if (IS_STRING(indexFromList(list, j)) && IS_NUMBER(pivot)) {
                 res = true;
             } else if (IS_STRING(indexFromList(list, j)) && IS_STRING(pivot)) {
-                res = wcscmp((AS_WCSTRING(indexFromList(list, j))), (AS_WCSTRING(pivot))) > 0;
+                res = compareStrings(flattenString(indexFromList(list, j)), flattenString(pivot)) > 0;
             }
          }
 
@@ -312,6 +779,159 @@ bool isValidListIndex(ObjList* list, int index) {
     return true;
 }
 
+// Slots of a map that index no entry.
+#define SLOT_EMPTY -1
+#define SLOT_DELETED -2
+#define MAP_MIN_CAPACITY 8
+
+static inline int32_t* mapSlots(MapEntry* entries, int capacity) {
+    return (int32_t*)(entries + mapEntryCapacity(capacity));
+}
+
+// Zero is the only number with two encodings, so keys use just the one, and
+// concatenations are flattened, so two keys are equal exactly when their
+// bits are. Flattening can collect, so the map and key have to be reachable.
+static inline Value mapKey(Value key) {
+    if (IS_NUMBER(key) && AS_NUMBER(key) == 0) return NUMBER_VAL(0);
+    if (IS_CONCAT(key)) return OBJ_VAL(flattenConcat(AS_CONCAT(key)));
+    return key;
+}
+
+static inline bool sameKey(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    return valuesEqual(a, b);
+#endif
+}
+
+// Strings are interned and objects never move, so a key hashes by its bits
+// whatever its type.
+static inline uint32_t hashKey(Value key) {
+#ifdef NAN_BOXING
+    uint64_t bits = key;
+#else
+    uint64_t bits;
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        memcpy(&bits, &number, sizeof(bits));
+    } else if (IS_OBJ(key)) {
+        bits = (uintptr_t)AS_OBJ(key);
+    } else {
+        bits = IS_BOOL(key) ? 2 + AS_BOOL(key) : 1;
+    }
+#endif
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// Returns the slot that indexes key's entry or, if there isn't one, the
+// slot it would go in.
+static int findMapSlot(ObjMap* map, Value key) {
+    int32_t* slots = mapSlots(map->entries, map->capacity);
+    uint32_t mask = (uint32_t)map->capacity - 1;
+    uint32_t index = hashKey(key) & mask;
+    int deleted = -1;
+    for (;;) {
+        int32_t slot = slots[index];
+        if (slot == SLOT_EMPTY) {
+            return deleted != -1 ? deleted : (int)index;
+        } else if (slot == SLOT_DELETED) {
+            if (deleted == -1) deleted = (int)index;
+        } else if (sameKey(map->entries[slot].key, key)) {
+            return (int)index;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+// Moves the live entries, in order, into a new allocation with room to add
+// as many again.
+static void rebuildMap(ObjMap* map) {
+    int capacity = MAP_MIN_CAPACITY;
+    while (mapEntryCapacity(capacity) < (map->count + 1) * 2) capacity *= 2;
+
+    MapEntry* entries = (MapEntry*)reallocate(NULL, 0, mapSize(capacity));
+    int32_t* slots = mapSlots(entries, capacity);
+    memset(slots, 0xFF, sizeof(int32_t) * capacity);
+
+    uint32_t mask = (uint32_t)capacity - 1;
+    int count = 0;
+    for (int i = 0; i < map->used; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
+        uint32_t index = hashKey(entry->key) & mask;
+        while (slots[index] != SLOT_EMPTY) index = (index + 1) & mask;
+        slots[index] = count;
+        entries[count++] = *entry;
+    }
+
+    reallocate(map->entries, mapSize(map->capacity), 0);
+    map->entries = entries;
+    map->capacity = capacity;
+    map->used = count;
+}
+
+ObjMap* newMap() {
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    map->count = 0;
+    map->used = 0;
+    map->capacity = 0;
+    map->entries = NULL;
+    return map;
+}
+
+bool mapGet(ObjMap* map, Value key, Value* value) {
+    if (map->count == 0) return false;
+    key = mapKey(key);
+    int32_t slot = mapSlots(map->entries, map->capacity)[findMapSlot(map, key)];
+    if (slot < 0) return false;
+    *value = map->entries[slot].value;
+    return true;
+}
+
+// Keys mustn't be NaN. Rebuilding can collect, so key and value have to be
+// reachable from somewhere else.
+void mapSet(ObjMap* map, Value key, Value value) {
+    key = mapKey(key);
+    if (map->count > 0) {
+        int32_t slot = mapSlots(map->entries, map->capacity)[findMapSlot(map, key)];
+        if (slot >= 0) {
+            map->entries[slot].value = value;
+            writeBarrier(&map->obj, value);
+            return;
+        }
+    }
+
+    if (map->used == mapEntryCapacity(map->capacity)) rebuildMap(map);
+    int index = findMapSlot(map, key);
+    mapSlots(map->entries, map->capacity)[index] = map->used;
+    map->entries[map->used].key = key;
+    map->entries[map->used].value = value;
+    map->used++;
+    map->count++;
+    writeBarrier(&map->obj, key);
+    writeBarrier(&map->obj, value);
+}
+
+bool mapDelete(ObjMap* map, Value key) {
+    if (map->count == 0) return false;
+    key = mapKey(key);
+    int32_t* slots = mapSlots(map->entries, map->capacity);
+    int index = findMapSlot(map, key);
+    int32_t slot = slots[index];
+    if (slot < 0) return false;
+    slots[index] = SLOT_DELETED;
+    map->entries[slot].key = UNDEFINED_VAL;
+    map->entries[slot].value = NIL_VAL;
+    map->count--;
+    return true;
+}
+
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
@@ -321,7 +941,7 @@ void printObject(Value value) {
                 wprintf(L"《静态方法》");
             break;
         case OBJ_CLASS:
-            wprintf(L"%ls", AS_CLASS(value)->name->chars);
+            writeString(stdout, AS_CLASS(value)->name);
             break;
         case OBJ_CLOSURE:
             printfunction(AS_CLOSURE(value)->function);
@@ -330,13 +950,18 @@ void printObject(Value value) {
             printfunction(AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
-            wprintf(L"%ls 实例", AS_INSTANCE(value)->klass->name->chars);
+            writeString(stdout, AS_INSTANCE(value)->klass->name);
+            wprintf(L" 实例");
             break;
         case OBJ_NATIVE:
             wprintf(L"《静态方法》");
             break;
         case OBJ_STRING:
-            wprintf(L"%ls", AS_WCSTRING(value));
+        case OBJ_CONCAT:
+            writeString(stdout, flattenString(value));
+            break;
+        case OBJ_BUILDER:
+            wprintf(L"构建器");
             break;
         case OBJ_UPVALUE:
             wprintf(L"升值");
@@ -344,5 +969,11 @@ void printObject(Value value) {
         case OBJ_LIST:
             printList(AS_LIST(value));
             break;
+        case OBJ_MAP:
+            printMap(AS_MAP(value));
+            break;
+        case OBJ_SHAPE:
+            wprintf(L"形状");
+            break;
     }
 }
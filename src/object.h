@@ -5,12 +5,15 @@
 #ifndef QI_OBJECT_H
 #define QI_OBJECT_H
 
+#include <stdio.h>
+#include <string.h>
+
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
 #include "value.h"
 
-#define OBJ_TYPE(value)        (AS_OBJ(value)->type)
+#define OBJ_TYPE(value)        ((ObjType)AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD);
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
@@ -18,8 +21,10 @@
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
-#define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_STRING(value)       isString(value)
+#define IS_CONCAT(value)       isObjType(value, OBJ_CONCAT)
 #define IS_LIST(value)         isObjType(value, OBJ_LIST)
+#define IS_MAP(value)          isObjType(value, OBJ_MAP)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
@@ -28,8 +33,10 @@
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
-#define AS_WCSTRING(value)     (((ObjString*)AS_OBJ(value))->chars)
+#define AS_CONCAT(value)       ((ObjConcat*)AS_OBJ(value))
 #define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value)          ((ObjMap*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 
 typedef enum {
     OBJ_BOUND_METHOD,
@@ -39,22 +46,37 @@ typedef enum {
     OBJ_INSTANCE,
     OBJ_NATIVE,
     OBJ_STRING,
+    OBJ_CONCAT,
+    OBJ_BUILDER,
     OBJ_UPVALUE,
-    OBJ_LIST
+    OBJ_LIST,
+    OBJ_MAP,
+    OBJ_SHAPE
 } ObjType;
 
+// The header takes up the first half of an object's first word, and each
+// kind of object packs its small fields into the rest. Mark bits live in the
+// bitmaps of the block an object is in.
 struct Obj {
-    ObjType type;
-    bool isMarked;
-    struct Obj* next;
+    uint8_t type;
+    // Set until the object survives its first collection.
+    bool isYoung;
+    // Whether the object is in vm.remembered.
+    bool isRemembered;
 };
 
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+#ifdef BASELINE_JIT
+    int hotness;
+#endif
     Chunk chunk;
     ObjString* name;
+#ifdef BASELINE_JIT
+    struct JitCode* jit;
+#endif
 } ObjFunction;
 
 typedef bool (*NativeFn)(int argCount, Value* args);
@@ -65,13 +87,48 @@ typedef struct {
     NativeFn function;
 } ObjNative;
 
+// Set in width once a character too wide for a string was stored into it.
+// Its characters then take four bytes each in a separate array, and chars
+// holds a pointer to that instead.
+#define STRING_MOVED 0x80
+
+// Characters, and a terminating null, are stored right after the header in
+// one, two or four bytes each, the fewest the widest of them fits in.
+// Interned strings always have the narrowest width, so equal ones have the
+// same bytes.
 struct ObjString {
     Obj obj;
+    uint8_t width;
     int length;
-    wchar_t* chars;
     uint32_t hash;
+    uint8_t chars[];
 };
 
+// Concatenations of at least CONCAT_MIN characters copy them into a builder
+// instead of a string of their own. The builder grows as strings are added
+// to the end of its newest concatenation, which every older one still
+// starts the same as.
+#define CONCAT_MIN 64
+
+typedef struct {
+    Obj obj;
+    uint8_t width;
+    int length;
+    int capacity;
+    uint8_t* chars;
+} ObjBuilder;
+
+// A string whose characters are the first length in builder. It is
+// flattened into an interned string the first time it is used as anything
+// but the left side of another concatenation, and is that string from then
+// on.
+typedef struct {
+    Obj obj;
+    int length;
+    ObjBuilder* builder;
+    ObjString* flat;
+} ObjConcat;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
@@ -81,22 +138,41 @@ typedef struct ObjUpvalue {
 
 typedef struct {
     Obj obj;
+    int upvalueCount;
     ObjFunction* function;
     ObjUpvalue** upvalues;
-    int upvalueCount;
 } ObjClosure;
 
+// Describes which slot each field of an instance lives in. Instances that
+// gained the same fields in the same order share one shape, and adding a
+// field moves an instance along a transition to the child shape.
+struct ObjShape {
+    Obj obj;
+    int slotCount;
+    Table slots;
+    Table transitions;
+};
+
 typedef struct {
     Obj obj;
+    int fieldCapacity;
     ObjString* name;
     Table methods;
+    ObjShape* rootShape;
+    // The 初始化 method, or nil, so calling the class needn't look it up.
+    Value initializer;
+    // Bumped whenever methods changes, which invalidates every invoke cache
+    // entry that resolved a method of this class.
+    int methodEpoch;
 } ObjClass;
 
 typedef struct {
     Obj obj;
-    ObjClass* klass;
-    Table fields;
     bool isStatic;
+    int fieldCapacity;
+    ObjClass* klass;
+    ObjShape* shape;
+    Value* fields;
 } ObjInstance;
 
 typedef struct {
@@ -113,16 +189,50 @@ typedef struct {
     Value* items;
 } ObjList;
 
+typedef struct {
+    Value key;
+    Value value;
+} MapEntry;
+
+// Entries are kept in the order their keys were first added, followed in
+// the same allocation by capacity slots that index them by hash. Removed
+// entries keep their place, with an undefined key, until the map is
+// rebuilt, so used counts them and count doesn't.
+typedef struct {
+    Obj obj;
+    int count;
+    int used;
+    int capacity;
+    MapEntry* entries;
+} ObjMap;
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjBoundMethod* newBoundNative(Value reciever, ObjNative* native);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass, bool isStatic);
+bool getInstanceField(ObjInstance* instance, ObjString* name, Value* value);
+void setInstanceField(ObjInstance* instance, ObjString* name, Value value);
+void addInstanceField(ObjInstance* instance, ObjShape* shape, Value value);
 ObjNative* newNative(NativeFn function, int arity);
-ObjString* takeString(wchar_t* chars, int length);
+ObjShape* newShape();
+int findShapeSlot(ObjShape* shape, ObjString* name);
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+ObjString* allocateString(int length, int width);
+ObjString* internString(ObjString* string);
 ObjString* copyString(const wchar_t* chars, int length);
-ObjString* handleEscapeSequences(ObjString* string);
+ObjString* sliceString(ObjString* string, int start, int end);
+void copyChars(ObjString* to, int index, ObjString* from, int start, int count);
+Value concatenateStrings(Value a, Value b);
+ObjString* flattenConcat(ObjConcat* concat);
+bool concatEqual(Value a, Value b);
+wchar_t* wideString(ObjString* string);
+void freeWideString(ObjString* string, wchar_t* chars);
+int findString(ObjString* string, ObjString* search, int start);
+int compareStrings(ObjString* a, ObjString* b);
+void writeString(FILE* file, ObjString* string);
+ObjString* handleEscapeSequences(const wchar_t* chars, int length);
 void storeToString(ObjString* string, int index, wchar_t value);
 wchar_t indexFromString(ObjString* string, int index);
 bool isValidStringIndex(ObjString* string, int index);
@@ -134,10 +244,75 @@ Value indexFromList(ObjList* list, int index);
 void deleteFromList(ObjList* list, int index);
 bool sortList(ObjList* list, int low, int high, ObjClosure* pred);
 bool isValidListIndex(ObjList* list, int index);
+ObjMap* newMap();
+bool mapGet(ObjMap* map, Value key, Value* value);
+void mapSet(ObjMap* map, Value key, Value value);
+bool mapDelete(ObjMap* map, Value key);
 void printObject(Value value);
 
+// Every string has room in chars for the pointer to moved characters.
+static inline size_t stringSize(int length, int width) {
+    size_t size = (size_t)(length + 1) * width;
+    return sizeof(ObjString) + (size < sizeof(uint32_t*) ? sizeof(uint32_t*) : size);
+}
+
+// A map is rebuilt before more than three quarters of its slots are in use,
+// so its entries only need room for that many.
+static inline int mapEntryCapacity(int capacity) {
+    return capacity - capacity / 4;
+}
+
+static inline size_t mapSize(int capacity) {
+    if (capacity == 0) return 0;
+    return sizeof(MapEntry) * mapEntryCapacity(capacity) + sizeof(int32_t) * capacity;
+}
+
+static inline int charWidth(wchar_t c) {
+    return c <= 0xFF ? 1 : c <= 0xFFFF ? 2 : 4;
+}
+
+// The bytes each character takes.
+static inline int stringWidth(ObjString* string) {
+    return string->width & STRING_MOVED ? 4 : string->width;
+}
+
+static inline uint32_t* movedChars(ObjString* string) {
+    uint32_t* chars;
+    memcpy(&chars, string->chars, sizeof(chars));
+    return chars;
+}
+
+static inline wchar_t charAt(ObjString* string, int index) {
+    switch (string->width) {
+        case 1: return string->chars[index];
+        case 2: return ((uint16_t*)string->chars)[index];
+        case 4: return ((uint32_t*)string->chars)[index];
+        default: return movedChars(string)[index];
+    }
+}
+
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline bool isString(Value value) {
+    return IS_OBJ(value) &&
+           (AS_OBJ(value)->type == OBJ_STRING || AS_OBJ(value)->type == OBJ_CONCAT);
+}
+
+// The characters of a string, flattening it first if it is a concatenation.
+// This can collect, so the value has to be reachable.
+static inline ObjString* flattenString(Value value) {
+    Obj* object = AS_OBJ(value);
+    if (object->type == OBJ_CONCAT) return flattenConcat((ObjConcat*)object);
+    return (ObjString*)object;
+}
+
+// The length of a string, without flattening it.
+static inline int stringLength(Value value) {
+    Obj* object = AS_OBJ(value);
+    if (object->type == OBJ_CONCAT) return ((ObjConcat*)object)->length;
+    return ((ObjString*)object)->length;
+}
+
 #endif //QI_OBJECT_H
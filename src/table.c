@@ -4,6 +4,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
@@ -11,144 +14,274 @@
 #include "value.h"
 #include "vm.h"
 
-#define TABLE_MAX_LOAD .75
+#define TABLE_MAX_LOAD .875
+#define TABLE_MIN_CAPACITY 8
+
+// Control bytes of slots without a key. Full slots hold a hash tag below
+// 0x80, and tables smaller than a group pad their one group with
+// CONTROL_PADDING, which matches nothing.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+#define CONTROL_PADDING 0xFF
+
+static inline int groupCount(int capacity) {
+    return capacity < GROUP_SIZE ? 1 : capacity / GROUP_SIZE;
+}
+
+// Capacities are powers of two, so this masks a hash down to a group.
+static inline uint32_t groupMaskOf(int capacity) {
+    return (uint32_t)(capacity - 1) / GROUP_SIZE;
+}
+
+// The entries and the control bytes share one allocation.
+static inline size_t tableSize(int capacity) {
+    if (capacity == 0) return 0;
+    return sizeof(Entry) * capacity + (size_t)groupCount(capacity) * GROUP_SIZE;
+}
+
+static inline uint8_t* controlBytes(Entry* entries, int capacity) {
+    return (uint8_t*)(entries + capacity);
+}
+
+// The top seven bits of a hash; the low bits pick the first group.
+static inline uint8_t hashTag(uint32_t hash) {
+    return (uint8_t)(hash >> 25);
+}
+
+// A bit for each slot in the group whose control byte is byte.
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    reallocate(table->entries, tableSize(table->capacity), 0);
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    Entry* tombstone = NULL;
-
-    uint32_t index = key->hash & (capacity - 1);
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+// Returns the slot key is in, or -1. Groups are probed in triangular
+// steps, which visits every one when their count is a power of two.
+static int findEntry(Entry* entries, int capacity, ObjString* key) {
+    uint8_t* control = controlBytes(entries, capacity);
+    uint32_t groupMask = groupMaskOf(capacity);
+    uint32_t group = key->hash & groupMask;
+    uint8_t tag = hashTag(key->hash);
+    for (uint32_t step = 1;; step++) {
+        uint8_t* bytes = control + group * GROUP_SIZE;
+        for (uint32_t match = matchByte(bytes, tag); match != 0; match &= match - 1) {
+            int index = group * GROUP_SIZE + __builtin_ctz(match);
+            if (entries[index].key == key) return index;
         }
+        // A key is never put past a group with an empty slot.
+        if (matchByte(bytes, CONTROL_EMPTY) != 0) return -1;
+        group = (group + step) & groupMask;
+    }
+}
 
-        index = (index + 1) & (capacity - 1);
+// Returns the first empty or deleted slot a key with this hash could go in.
+static int findFreeSlot(Entry* entries, int capacity, uint32_t hash) {
+    uint8_t* control = controlBytes(entries, capacity);
+    uint32_t groupMask = groupMaskOf(capacity);
+    uint32_t group = hash & groupMask;
+    for (uint32_t step = 1;; step++) {
+        uint8_t* bytes = control + group * GROUP_SIZE;
+        uint32_t free = matchByte(bytes, CONTROL_EMPTY) | matchByte(bytes, CONTROL_DELETED);
+        if (free != 0) return group * GROUP_SIZE + __builtin_ctz(free);
+        group = (group + step) & groupMask;
     }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findEntry(table->entries, table->capacity, key);
+    if (index < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
+// The capacity a table of count keys is rebuilt with: at most half as
+// full as the load limit allows, so it takes as many insertions again to
+// fill.
+static int capacityFor(int count) {
+    int capacity = TABLE_MIN_CAPACITY;
+    while (count > capacity * TABLE_MAX_LOAD / 2) capacity *= 2;
+    return capacity;
+}
+
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    Entry* entries = (Entry*)reallocate(NULL, 0, tableSize(capacity));
+    uint8_t* control = controlBytes(entries, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+    memset(control + capacity, CONTROL_PADDING, groupCount(capacity) * GROUP_SIZE - capacity);
 
-    table->count = 0;
+    uint8_t* oldControl = controlBytes(table->entries, table->capacity);
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (oldControl[i] & CONTROL_EMPTY) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        Entry* entry = &table->entries[i];
+        int index = findFreeSlot(entries, capacity, entry->hash);
+        control[index] = oldControl[i];
+        entries[index] = *entry;
     }
+    table->tombstones = 0;
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    reallocate(table->entries, tableSize(table->capacity), 0);
     table->entries = entries;
     table->capacity = capacity;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+    if (table->count > 0) {
+        int index = findEntry(table->entries, table->capacity, key);
+        if (index >= 0) {
+            table->entries[index].value = value;
+            return false;
+        }
+    }
+
+    // Tables are only resized here, never while a collection deletes from
+    // them. They are rebuilt once keys and tombstones reach the load limit,
+    // tombstones alone fill a quarter of the slots, or the keys left fill
+    // less than a thirty-second of them, with a capacity that fits the keys
+    // left. That drops the tombstones, and grows, keeps or shrinks the table.
+    // Keys deleted from a group with an empty slot leave no tombstone, so
+    // without the last check a table whose keys mostly die, like the string
+    // table after a major collection, would keep its size.
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD ||
+        table->tombstones > table->capacity / 4 ||
+        table->count < table->capacity / 32) {
+        int capacity = capacityFor(table->count);
+        // A table rebuilt smaller keeps room for a few times the keys it
+        // has left, so one that empties and refills, like the string table
+        // between minor collections, doesn't resize back and forth.
+        if (capacity < table->capacity) {
+            capacity = capacityFor(table->count * 4);
+            if (capacity > table->capacity) capacity = table->capacity;
+        }
         adjustCapacity(table, capacity);
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    int index = findFreeSlot(table->entries, table->capacity, key->hash);
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    if (control[index] == CONTROL_DELETED) table->tombstones--;
+    table->count++;
+
+    control[index] = hashTag(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->entries[index].hash = key->hash;
+    return true;
+}
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+static void deleteSlot(Table* table, int index) {
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    // No probe has gone on past a group that still has an empty slot, so
+    // a slot in one can be empty again instead of deleted.
+    if (matchByte(control + index / GROUP_SIZE * GROUP_SIZE, CONTROL_EMPTY) != 0) {
+        control[index] = CONTROL_EMPTY;
+    } else {
+        control[index] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+    table->count--;
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findEntry(table->entries, table->capacity, key);
+    if (index < 0) return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    deleteSlot(table, index);
     return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
+    uint8_t* control = controlBytes(from->entries, from->capacity);
     for (int i = 0; i < from->capacity; ++i) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (!(control[i] & CONTROL_EMPTY)) {
+            tableSet(to, from->entries[i].key, from->entries[i].value);
         }
     }
 }
 
-ObjString* tableFindString(Table* table, const wchar_t* chars, int length, uint32_t hash) {
+// Finds a key with the given characters, width bytes each.
+ObjString* tableFindString(Table* table, const uint8_t* chars, int length, int width, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length * sizeof(wchar_t)) == 0) {
-            // We found it.
-            return entry->key;
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    uint32_t groupMask = groupMaskOf(table->capacity);
+    uint32_t group = hash & groupMask;
+    uint8_t tag = hashTag(hash);
+    for (uint32_t step = 1;; step++) {
+        uint8_t* bytes = control + group * GROUP_SIZE;
+        for (uint32_t match = matchByte(bytes, tag); match != 0; match &= match - 1) {
+            Entry* entry = &table->entries[group * GROUP_SIZE + __builtin_ctz(match)];
+            if (entry->hash == hash &&
+                entry->key->length == length &&
+                entry->key->width == width &&
+                memcmp(entry->key->chars, chars, (size_t)length * width) == 0) {
+                // We found it.
+                return entry->key;
+            }
         }
+        if (matchByte(bytes, CONTROL_EMPTY) != 0) return NULL;
+        group = (group + step) & groupMask;
+    }
+}
+
+// The average number of groups a lookup of each key goes through.
+double tableProbeLength(Table* table) {
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    uint32_t groupMask = groupMaskOf(table->capacity);
+    size_t probes = 0;
+    int keys = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (control[i] & CONTROL_EMPTY) continue;
 
-        index = (index + 1) & (table->capacity - 1);
+        uint32_t group = table->entries[i].hash & groupMask;
+        for (uint32_t step = 1; group != (uint32_t)i / GROUP_SIZE; step++) {
+            group = (group + step) & groupMask;
+            probes++;
+        }
+        probes++;
+        keys++;
     }
+    return keys == 0 ? 0 : (double)probes / keys;
 }
 
 void tableRemoveWhite(Table* table) {
+    uint8_t* control = controlBytes(table->entries, table->capacity);
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (!(control[i] & CONTROL_EMPTY) && !isMarked(&table->entries[i].key->obj)) {
+            deleteSlot(table, i);
         }
     }
 }
 
 void markTable(Table* table) {
+    uint8_t* control = controlBytes(table->entries, table->capacity);
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        if (control[i] & CONTROL_EMPTY) continue;
+        markObject((Obj*)table->entries[i].key);
+        markValue(table->entries[i].value);
     }
-}
\ No newline at end of file
+}
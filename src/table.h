@@ -5,13 +5,24 @@
 #ifndef QI_TABLE_H
 #define QI_TABLE_H
 
+// Tables probe a group of GROUP_SIZE slots at a time, as in SwissTable.
+// Each slot has a control byte, kept after the entries, that says whether
+// it is empty or deleted or else holds seven bits of its key's hash, so a
+// lookup only compares the keys whose bits match.
+#define GROUP_SIZE 16
+
+// Entries keep their key's hash so probing and resizing needn't load the
+// key.
 typedef struct {
     ObjString* key;
     Value value;
+    uint32_t hash;
 } Entry;
 
 typedef struct {
     int count;
+    // Deleted slots, which make probes go on until the table is rebuilt.
+    int tombstones;
     int capacity;
     Entry* entries;
 } Table;
@@ -22,7 +33,8 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
-ObjString* tableFindString(Table* table, const wchar_t* chars, int length, uint32_t hash);
+ObjString* tableFindString(Table* table, const uint8_t* chars, int length, int width, uint32_t hash);
+double tableProbeLength(Table* table);
 void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
@@ -50,6 +50,7 @@ void printValue(Value value) {
         case VAL_NIL: wprintf(L"空"); break;
         case VAL_NUMBER: wprintf(L"%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: break; // Never reaches user code.
     }
 #endif
 }
@@ -59,14 +60,18 @@ bool valuesEqual(Value a, Value b) {
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b) return true;
+    // A concatenation equals the string it flattens to.
+    return IS_OBJ(a) && IS_OBJ(b) && (IS_CONCAT(a) || IS_CONCAT(b)) && concatEqual(a, b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            return AS_OBJ(a) == AS_OBJ(b) ||
+                   ((IS_CONCAT(a) || IS_CONCAT(b)) && concatEqual(a, b));
         default:         return false; // Unreachable.
     }
 #endif
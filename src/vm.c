@@ -8,6 +8,7 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <wctype.h>
 #include <math.h>
 
 #include "common.h"
@@ -18,8 +19,18 @@
 #include "vm.h"
 #include "core_module.h"
 
+#ifdef BASELINE_JIT
+#include "jit.h"
+#endif
+
 VM vm;
 
+#ifdef DEBUG_CACHE_STATS
+#define COUNT_CACHE(counter) (vm.counter++)
+#else
+#define COUNT_CACHE(counter) do { } while (false)
+#endif
+
 static void resetStack() {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
@@ -41,60 +52,216 @@ static void runtimeError(const wchar_t* format, ...) {
         if (function->name == NULL) {
             fwprintf(stderr, L"脚本\n");
         } else {
-            fwprintf(stderr, L"%ls（）\n", function->name->chars);
+            writeString(stderr, function->name);
+            fwprintf(stderr, L"（）\n");
         }
     }
 
     resetStack();
 }
 
+// Reports an error with a %ls in its format for the string.
+static void stringError(const wchar_t* format, ObjString* string) {
+    wchar_t* chars = wideString(string);
+    runtimeError(format, chars);
+    freeWideString(string, chars);
+}
+
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(vm.globalValues.count - 1));
+    pop();
+    return vm.globalValues.count - 1;
+}
+
 void defineNativeInstance(wchar_t* name, ObjInstance* instance) {
-    push(OBJ_VAL(copyString(name, (int)wcslen(name))));
     push(OBJ_VAL(instance));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(copyString(name, (int)wcslen(name))));
+    int slot = globalSlot(AS_STRING(vm.stackTop[-1]));
+    vm.globalValues.values[slot] = vm.stackTop[-2];
     pop();
     pop();
 }
 
 void defineNative(const wchar_t* name, NativeFn function, int arity, ObjClass* klass) {
+    push(OBJ_VAL(klass));
     push(OBJ_VAL(copyString(name, (int)wcslen(name))));
     push(OBJ_VAL(newNative(function, arity)));
-    tableSet(&klass->methods, AS_STRING(vm.stack[0]), vm.stack[1]);
+    tableSet(&klass->methods, AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
+    writeBarrier(&klass->obj, vm.stackTop[-2]);
+    writeBarrier(&klass->obj, vm.stackTop[-1]);
+    klass->methodEpoch++;
+    pop();
     pop();
     pop();
 }
 
 void defineProperty(const wchar_t* name, Value value, ObjInstance* instance) {
+    push(OBJ_VAL(instance));
     push(OBJ_VAL(copyString(name, (int)wcslen(name))));
     push(value);
-    tableSet(&instance->fields, AS_STRING(vm.stack[0]), vm.stack[1]);
+    setInstanceField(instance, AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
+    pop();
+    pop();
     pop();
+}
+
+// Built-in string, list and map methods are found through vm.stringMethods,
+// vm.listMethods and vm.mapMethods, which map each interned name to one of these selectors.
+typedef enum {
+    STRING_LENGTH,
+    STRING_INDEX,
+    STRING_COUNT,
+    STRING_SPLIT,
+    STRING_REPLACE,
+    STRING_TRIM,
+    STRING_TRIM_START,
+    STRING_TRIM_END,
+    STRING_UPPER,
+    STRING_LOWER,
+    STRING_SUBSTRING,
+} StringMethod;
+
+typedef enum {
+    LIST_PUSH,
+    LIST_POP,
+    LIST_INSERT,
+    LIST_DELETE,
+    LIST_LENGTH,
+    LIST_FILTER,
+    LIST_SORT,
+} ListMethod;
+
+typedef enum {
+    MAP_LENGTH,
+    MAP_KEYS,
+    MAP_VALUES,
+    MAP_HAS,
+    MAP_DELETE,
+} MapMethod;
+
+static void defineSelector(Table* table, const wchar_t* name, int selector) {
+    push(OBJ_VAL(copyString(name, (int)wcslen(name))));
+    tableSet(table, AS_STRING(vm.stack[0]), NUMBER_VAL(selector));
     pop();
 }
 
+static void initSelectors() {
+    defineSelector(&vm.stringMethods, L"长度", STRING_LENGTH);
+    defineSelector(&vm.stringMethods, L"指数", STRING_INDEX);
+    defineSelector(&vm.stringMethods, L"计数", STRING_COUNT);
+    defineSelector(&vm.stringMethods, L"拆分", STRING_SPLIT);
+    defineSelector(&vm.stringMethods, L"替换", STRING_REPLACE);
+    defineSelector(&vm.stringMethods, L"修剪", STRING_TRIM);
+    defineSelector(&vm.stringMethods, L"修剪始", STRING_TRIM_START);
+    defineSelector(&vm.stringMethods, L"修剪端", STRING_TRIM_END);
+    defineSelector(&vm.stringMethods, L"大写", STRING_UPPER);
+    defineSelector(&vm.stringMethods, L"小写", STRING_LOWER);
+    defineSelector(&vm.stringMethods, L"子串", STRING_SUBSTRING);
+
+    defineSelector(&vm.listMethods, L"推", LIST_PUSH);
+    defineSelector(&vm.listMethods, L"弹", LIST_POP);
+    defineSelector(&vm.listMethods, L"插", LIST_INSERT);
+    defineSelector(&vm.listMethods, L"删", LIST_DELETE);
+    defineSelector(&vm.listMethods, L"长度", LIST_LENGTH);
+    defineSelector(&vm.listMethods, L"过滤", LIST_FILTER);
+    defineSelector(&vm.listMethods, L"排序", LIST_SORT);
+
+    defineSelector(&vm.mapMethods, L"长度", MAP_LENGTH);
+    defineSelector(&vm.mapMethods, L"键", MAP_KEYS);
+    defineSelector(&vm.mapMethods, L"值", MAP_VALUES);
+    defineSelector(&vm.mapMethods, L"有", MAP_HAS);
+    defineSelector(&vm.mapMethods, L"删", MAP_DELETE);
+}
+
 void initVM() {
+    vm.frames = calloc(FRAMES_INITIAL, sizeof(CallFrame));
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.stack = malloc(sizeof(Value) * FRAMES_INITIAL * UINT8_COUNT);
+    if (vm.frames == NULL || vm.stack == NULL) exit(1);
     resetStack();
-    vm.objects = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
 
+    vm.blocks = NULL;
+    vm.largeBlocks = NULL;
+    vm.spareBlocks = NULL;
+    vm.spareBytes = 0;
+    vm.allocBlock = NULL;
+    vm.allocLine = 0;
+    vm.allocCursor = NULL;
+    vm.allocLimit = NULL;
+    vm.spanStart = NULL;
+    vm.youngSpans = NULL;
+    vm.youngSpanCount = 0;
+    vm.youngSpanCapacity = 0;
+    vm.youngBytes = 0;
+    for (int i = 0; i < POOL_CLASSES; i++) vm.pools[i] = NULL;
+    vm.slabs = NULL;
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.youngOnly = false;
+    vm.gcPhase = GC_IDLE;
+    vm.gcPauseBudget = GC_PAUSE_BUDGET * 1000;
+    vm.sweepBlock = NULL;
+    vm.eagerSweeps = 0;
+    vm.lazySweeps = 0;
+    vm.gcMaxPause = 0;
+    vm.markThreads = MARK_THREADS;
+
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalNames);
+    initValueArray(&vm.globalValues);
     initTable(&vm.strings);
+    initTable(&vm.stringMethods);
+    initTable(&vm.listMethods);
+    initTable(&vm.mapMethods);
 
     vm.initString = NULL;
     vm.initString = copyString(L"初始化", 3);
     vm.markValue = true;
+    initSelectors();
+
+#ifdef DEBUG_CACHE_STATS
+    vm.propertyCacheHits = 0;
+    vm.propertyCacheMisses = 0;
+    vm.invokeCacheHits = 0;
+    vm.invokeCacheMisses = 0;
+#endif
 
     initCoreClass();
 }
 
 void freeVM() {
-    freeTable(&vm.globals);
+#ifdef DEBUG_CACHE_STATS
+    fwprintf(stderr, L"-- property cache: %zu hits, %zu misses\n",
+             vm.propertyCacheHits, vm.propertyCacheMisses);
+    fwprintf(stderr, L"-- invoke cache: %zu hits, %zu misses\n",
+             vm.invokeCacheHits, vm.invokeCacheMisses);
+#endif
+#ifdef DEBUG_OPCODE_NGRAMS
+    printOpcodeNgrams();
+#endif
+
+    free(vm.frames);
+    free(vm.stack);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalNames);
+    freeValueArray(&vm.globalValues);
     freeTable(&vm.strings);
+    freeTable(&vm.stringMethods);
+    freeTable(&vm.listMethods);
+    freeTable(&vm.mapMethods);
     vm.initString = NULL;
     freeObjects();
 }
@@ -124,13 +291,57 @@ static bool containsChar(wchar_t* input, wchar_t c) {
     return false;
 }
 
+#ifdef BASELINE_JIT
+// Calls and loop back-edges both count towards compiling a function.
+static inline void warmUp(ObjFunction* function) {
+    if (function->jit == NULL && ++function->hotness == JIT_THRESHOLD) {
+        jitCompile(function);
+    }
+}
+#endif
+
+// Doubles both stacks, keeping UINT8_COUNT values of stack for each frame.
+// Moving the value stack moves everything that points into it along with it.
+static __attribute__((noinline)) bool growStacks() {
+    if (vm.frameCapacity == FRAMES_MAX) return false;
+    int oldCapacity = vm.frameCapacity;
+    vm.frameCapacity *= 2;
+    vm.frames = realloc(vm.frames, sizeof(CallFrame) * vm.frameCapacity);
+    if (vm.frames == NULL) exit(1);
+    // Frames are only ever pushed with callClosure clear.
+    memset(vm.frames + oldCapacity, 0, sizeof(CallFrame) * oldCapacity);
+
+    // The old stack is freed only once nothing points into it, so the
+    // pointers are rebased while they still point at something.
+    Value* old = vm.stack;
+    vm.stack = malloc(sizeof(Value) * vm.frameCapacity * UINT8_COUNT);
+    if (vm.stack == NULL) exit(1);
+    memcpy(vm.stack, old, sizeof(Value) * (vm.stackTop - old));
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = vm.stack + (vm.frames[i].slots - old);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = vm.stack + (upvalue->location - old);
+    }
+    vm.stackTop = vm.stack + (vm.stackTop - old);
+    free(old);
+    return true;
+}
+
+// Calls back into the VM from C recurse on the C stack, which runs out long
+// before the frames do.
+static bool cStackExhausted() {
+    char here;
+    return vm.cStackBase - &here > C_STACK_MAX;
+}
+
 static bool call(ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError(L"需要 %d 个参数，但得到 %d。", closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount == vm.frameCapacity && !growStacks()) {
         runtimeError(L"堆栈溢出。");
         return false;
     }
@@ -139,6 +350,9 @@ static bool call(ObjClosure* closure, int argCount) {
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+#ifdef BASELINE_JIT
+    warmUp(closure->function);
+#endif
     return true;
 }
 
@@ -153,9 +367,8 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass, false));
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (!IS_NIL(klass->initializer)) {
+                    return call(AS_CLOSURE(klass->initializer), argCount);
                 } else if (argCount != 0) {
                     runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
                     return false;
@@ -172,13 +385,7 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, bool isStatic, ObjString* name, int argCount, CallFrame* frame, uint8_t* ip) {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
-        frame->ip = ip;
-        runtimeError(L"未定义的属性「%ls」。", name->chars);
-        return false;
-    }
+static bool callMethod(Value method, bool isStatic, int argCount) {
     if (!isStatic) return call(AS_CLOSURE(method), argCount);
 
     ObjNative* native = AS_NATIVE(method);
@@ -190,523 +397,770 @@ static bool invokeFromClass(ObjClass* klass, bool isStatic, ObjString* name, int
         vm.stackTop -= argCount;
         return true;
     } else {
-        if (vm.frameCount != 0) runtimeError(AS_STRING(vm.stackTop[-argCount - 1])->chars);
+        if (vm.frameCount != 0) stringError(L"%ls", AS_STRING(vm.stackTop[-argCount - 1]));
+        return false;
+    }
+}
+
+static inline bool findCachedMethod(InlineCache* cache, Obj* receiver, ObjClass* klass, Value* method) {
+    for (int i = 0; i < cache->methodCount; i++) {
+        if (cache->methods[i].receiver == receiver &&
+            cache->methods[i].epoch == klass->methodEpoch) {
+            COUNT_CACHE(invokeCacheHits);
+            *method = cache->methods[i].method;
+            return true;
+        }
+    }
+
+    COUNT_CACHE(invokeCacheMisses);
+    return false;
+}
+
+// Inline caches belong to the function running in the top frame, which has
+// to be remembered once its caches point at young objects.
+static inline void cacheBarrier(Value value) {
+    writeBarrier(&vm.frames[vm.frameCount - 1].closure->function->obj, value);
+}
+
+static void cacheMethod(InlineCache* cache, Obj* receiver, ObjClass* klass, Value method) {
+    if (cache->methods == NULL) {
+        cache->methods = ALLOCATE(MethodCacheEntry, METHOD_CACHE_SIZE);
+    }
+
+    // A receiver whose class has changed since it was cached gets its entry
+    // back. Sites that see more receivers than this are left to the slow path.
+    int index = 0;
+    while (index < cache->methodCount && cache->methods[index].receiver != receiver) index++;
+    if (index == METHOD_CACHE_SIZE) return;
+    if (index == cache->methodCount) cache->methodCount++;
+    cache->methods[index].receiver = receiver;
+    cache->methods[index].method = method;
+    cache->methods[index].epoch = klass->methodEpoch;
+    cacheBarrier(OBJ_VAL(receiver));
+    cacheBarrier(method);
+}
+
+static bool invokeFromClass(ObjClass* klass, bool isStatic, ObjString* name, int argCount, InlineCache* cache, Obj* receiver, CallFrame* frame, uint8_t* ip) {
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) {
+        frame->ip = ip;
+        stringError(L"未定义的属性「%ls」。", name);
         return false;
     }
+    cacheMethod(cache, receiver, klass, method);
+    return callMethod(method, isStatic, argCount);
 }
 
-static bool invokeInstance(const Value* receiver, ObjString* name, int argCount, CallFrame* frame, uint8_t* ip) {
+static bool invokeInstance(const Value* receiver, ObjString* name, int argCount, InlineCache* cache, CallFrame* frame, uint8_t* ip) {
     ObjInstance* instance = AS_INSTANCE(*receiver);
 
+    // The shape pins down both the class and the absence of a field that
+    // would shadow the method, so it is all a cached call has to check.
+    Value method;
+    if (findCachedMethod(cache, (Obj*)instance->shape, instance->klass, &method)) {
+        return callMethod(method, instance->isStatic, argCount);
+    }
+
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (getInstanceField(instance, name, &value)) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, instance->isStatic, name, argCount, frame, ip);
+    return invokeFromClass(instance->klass, instance->isStatic, name, argCount, cache, (Obj*)instance->shape, frame, ip);
 }
 
 static bool invokeString(const Value* receiver, ObjString* name, int argCount, CallFrame* frame, uint8_t* ip) {
-    if (wcscmp(name->chars, L"长度") == 0) {
-        // Returns the length of the string
-        if (argCount != 0) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
-            return false;
-        }
+    Value selector;
+    if (!tableGet(&vm.stringMethods, name, &selector)) {
+        frame->ip = ip;
+        stringError(L"未定义的属性「%ls」。", name);
+        return false;
+    }
 
-        vm.stackTop -= argCount + 1;
-        push(NUMBER_VAL(AS_STRING(*receiver)->length));
-        return true;
-    } else if (wcscmp(name->chars, L"指数") == 0) {
-        // Returns the index of the first char matching the input string
-        ObjString* str = AS_STRING(*receiver);
-        if (argCount != 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (!IS_STRING(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
+    switch ((int)AS_NUMBER(selector)) {
+        case STRING_LENGTH: {
+            // Returns the length of the string
+            if (argCount != 0) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
+                return false;
+            }
+
+            vm.stackTop -= argCount + 1;
+            push(NUMBER_VAL(stringLength(*receiver)));
+            return true;
         }
+        case STRING_INDEX: {
+            // Returns the index of the first char matching the input string
+            ObjString* str = flattenString(*receiver);
+            if (argCount != 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (!IS_STRING(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        ObjString* search = AS_STRING(peek(argCount - 1));
-        wchar_t* found = wcsstr(str->chars, search->chars);
-        vm.stackTop -= argCount + 1;
+            ObjString* search = flattenString(peek(argCount - 1));
+            int found = findString(str, search, 0);
+            vm.stackTop -= argCount + 1;
 
-        push(NUMBER_VAL(found == NULL ? -1 : found - str->chars));
+            push(NUMBER_VAL(found));
 
-        return true;
-    } else if (wcscmp(name->chars, L"计数") == 0) {
-        // Returns the amount of times the input string was found
-        ObjString* str = AS_STRING(*receiver);
-        if (argCount != 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (!IS_STRING(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
+            return true;
         }
+        case STRING_COUNT: {
+            // Returns the amount of times the input string was found
+            ObjString* str = flattenString(*receiver);
+            if (argCount != 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (!IS_STRING(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        ObjString* search = AS_STRING(peek(argCount - 1));
-        double count = 0;
-        const wchar_t* tmp = wcsstr(str->chars, search->chars);
-        while (tmp) {
-            count++;
-            tmp++;
-            tmp = wcsstr(tmp, search->chars);
-        }
-        vm.stackTop -= argCount + 1;
+            ObjString* search = flattenString(peek(argCount - 1));
+            double count = 0;
+            for (int found = findString(str, search, 0); found != -1;
+                 found = findString(str, search, found + 1)) {
+                count++;
+            }
+            vm.stackTop -= argCount + 1;
 
-        push(NUMBER_VAL(count));
+            push(NUMBER_VAL(count));
 
-        return true;
-    } else if (wcscmp(name->chars, L"拆分") == 0) {
-        // Returns a split string as a list.
-        ObjString* str = AS_STRING(*receiver);
-        if (argCount != 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (!IS_STRING(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
+            return true;
         }
+        case STRING_SPLIT: {
+            // Returns a split string as a list.
+            ObjString* str = flattenString(*receiver);
+            if (argCount != 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (!IS_STRING(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        ObjString* search = AS_STRING(peek(argCount - 1));
-        ObjList* list = newList();
-        wchar_t *last, *token, *tmp, *toFree;
-        toFree = tmp = wcsdup(str->chars);
-
-        token = wcstok(tmp, search->chars, &last);
-        while (token != NULL) {
-            insertToList(list, OBJ_VAL(copyString(token, wcslen(token))), list->count);
-            token = wcstok(NULL, search->chars, &last);
-        }
+            ObjString* search = flattenString(peek(argCount - 1));
+            ObjList* list = newList();
+            // Keep the list reachable while its items are allocated.
+            push(OBJ_VAL(list));
+            // Any of the separator's characters splits the string, and
+            // empty pieces are left out.
+            wchar_t* separators = wideString(search);
+            int start = 0;
+            while (start < str->length) {
+                int end = start;
+                while (end < str->length && !containsChar(separators, charAt(str, end))) end++;
+                if (end > start) {
+                    push(OBJ_VAL(sliceString(str, start, end)));
+                    insertToList(list, peek(0), list->count);
+                    pop();
+                }
+                start = end + 1;
+            }
+            freeWideString(search, separators);
 
-        free(toFree);
-        vm.stackTop -= argCount + 1;
+            vm.stackTop -= argCount + 2;
 
-        push(OBJ_VAL(list));
+            push(OBJ_VAL(list));
 
-        return true;
-    } else if (wcscmp(name->chars, L"替换") == 0) {
-        // Returns a string with all occurrences of the 1st argument replaced with the 2nd argument.
-        ObjString* str = AS_STRING(*receiver);
-        if (argCount != 2) {
-            frame->ip = ip;
-            runtimeError(L"需要 2 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (!IS_STRING(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
-        } else if (!IS_STRING(peek(argCount - 2))) {
-            frame->ip = ip;
-            runtimeError(L"参数 2（结尾）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
+            return true;
         }
-
-        ObjString* old = AS_STRING(peek(argCount - 1));
-        ObjString* new = AS_STRING(peek(argCount - 2));
-        wchar_t *buff, *next;
-        buff = wcsdup(str->chars);
-        int pos;
-
-        wchar_t* found = wcsstr(str->chars, old->chars);
-        pos = found == NULL ? -1 : (int)(found - str->chars);
-        if (pos != -1) {
-            buff[0] = 0;
-            wcsncpy(buff, str->chars, pos);
-            buff[pos] = 0;
-            wcscat(buff, new->chars);
-            next = str->chars + pos + wcslen(old->chars);
-
-            while (wcslen(next) != 0) {
-                found = wcsstr(next, old->chars);
-                pos = found == NULL ? -1 : (int)(found - next);
-                if (pos == -1) {
-                    wcscat(buff, next);
-                    break;
-                }
-                wcsncat(buff, next, pos);
-                wcscat(buff, new->chars);
-                next = next + pos + wcslen(old->chars);
+        case STRING_REPLACE: {
+            // Returns a string with all occurrences of the 1st argument replaced with the 2nd argument.
+            ObjString* str = flattenString(*receiver);
+            if (argCount != 2) {
+                frame->ip = ip;
+                runtimeError(L"需要 2 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (!IS_STRING(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            } else if (!IS_STRING(peek(argCount - 2))) {
+                frame->ip = ip;
+                runtimeError(L"参数 2（结尾）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
             }
-        }
 
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(copyString(buff, wcslen(buff))));
+            ObjString* old = flattenString(peek(argCount - 1));
+            ObjString* new = flattenString(peek(argCount - 2));
+            if (old->length == 0) {
+                vm.stackTop -= argCount;
+                return true;
+            }
 
-        return true;
-    } else if (wcscmp(name->chars, L"修剪") == 0) {
-        // Returns a string with whitespace or chars of given string removed from the start and end of the input string
-        const wchar_t* str = AS_STRING(*receiver)->chars;
-        if (argCount > 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 到 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (argCount == 1 && !IS_STRING(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
-        }
+            // Count the matches first so the result is allocated at its
+            // final length.
+            int matches = 0;
+            for (int found = findString(str, old, 0); found != -1;
+                 found = findString(str, old, found + old->length)) {
+                matches++;
+            }
 
-        wchar_t* remove = argCount ? AS_STRING(peek(argCount - 1))->chars : NULL;
-        const wchar_t* end;
-        size_t res_size;
-        while(containsChar(remove, (wchar_t)*str)) str++;
+            int width = stringWidth(str) > stringWidth(new) ? stringWidth(str) : stringWidth(new);
+            ObjString* result = allocateString(str->length + matches * (new->length - old->length), width);
+            int dest = 0;
+            int next = 0;
+            for (int found = findString(str, old, 0); found != -1;
+                 found = findString(str, old, next)) {
+                copyChars(result, dest, str, next, found - next);
+                dest += found - next;
+                copyChars(result, dest, new, 0, new->length);
+                dest += new->length;
+                next = found + old->length;
+            }
+            copyChars(result, dest, str, next, str->length - next);
 
-        if(*str == 0) {
+            result = internString(result);
             vm.stackTop -= argCount + 1;
-            push(OBJ_VAL(copyString(0, 1)));
+            push(OBJ_VAL(result));
+
             return true;
         }
+        case STRING_TRIM: {
+            // Returns a string with whitespace or chars of given string removed from the start and end of the input string
+            ObjString* string = flattenString(*receiver);
+            if (argCount > 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 到 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (argCount == 1 && !IS_STRING(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        end = str + wcslen(str) - 1;
-        while(end > str && containsChar(remove, (wchar_t)*end)) end--;
-        end++;
+            ObjString* removeString = argCount ? flattenString(peek(argCount - 1)) : NULL;
+            wchar_t* chars = wideString(string);
+            wchar_t* remove = removeString != NULL ? wideString(removeString) : NULL;
+            const wchar_t* str = chars;
+            const wchar_t* end;
+            size_t res_size;
+            ObjString* result;
+            while(containsChar(remove, (wchar_t)*str)) str++;
+
+            if(*str == 0) {
+                result = copyString(L"", 0);
+            } else {
+                end = str + wcslen(str) - 1;
+                while(end > str && containsChar(remove, (wchar_t)*end)) end--;
+                end++;
+
+                res_size = (end - str) < wcslen(str)-1 ? (end - str) : wcslen(str)-1;
+                result = copyString(str, res_size);
+            }
 
-        res_size = (end - str) < wcslen(str)-1 ? (end - str) : wcslen(str)-1;
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(copyString(str, res_size)));
-        return true;
-    } else if (wcscmp(name->chars, L"修剪始") == 0) {
-        // Returns a string with whitespace or chars of given string removed from the start of the input string
-        const wchar_t* str = AS_STRING(*receiver)->chars;
-        if (argCount > 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 到 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (argCount == 1 && !IS_STRING(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
+            freeWideString(string, chars);
+            if (remove != NULL) freeWideString(removeString, remove);
+            vm.stackTop -= argCount + 1;
+            push(OBJ_VAL(result));
+            return true;
         }
+        case STRING_TRIM_START: {
+            // Returns a string with whitespace or chars of given string removed from the start of the input string
+            ObjString* string = flattenString(*receiver);
+            if (argCount > 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 到 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (argCount == 1 && !IS_STRING(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        wchar_t* remove = argCount ? AS_STRING(peek(argCount - 1))->chars : NULL;
-        size_t res_size;
-        while(containsChar(remove, (wchar_t)*str)) str++;
+            ObjString* removeString = argCount ? flattenString(peek(argCount - 1)) : NULL;
+            wchar_t* chars = wideString(string);
+            wchar_t* remove = removeString != NULL ? wideString(removeString) : NULL;
+            const wchar_t* str = chars;
+            while(containsChar(remove, (wchar_t)*str)) str++;
+            ObjString* result = copyString(str, wcslen(str));
 
-        if(*str == 0) {
+            freeWideString(string, chars);
+            if (remove != NULL) freeWideString(removeString, remove);
             vm.stackTop -= argCount + 1;
-            push(OBJ_VAL(copyString(0, 1)));
+            push(OBJ_VAL(result));
             return true;
         }
+        case STRING_TRIM_END: {
+            // Returns a string with whitespace or chars of given string removed from the end of the input string
+            ObjString* string = flattenString(*receiver);
+            if (argCount > 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 到 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (argCount == 1 && !IS_STRING(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(copyString(str, wcslen(str))));
-        return true;
-    } else if (wcscmp(name->chars, L"修剪端") == 0) {
-        // Returns a string with whitespace or chars of given string removed from the end of the input string
-        const wchar_t* str = AS_STRING(*receiver)->chars;
-        if (argCount > 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 到 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (argCount == 1 && !IS_STRING(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（开头）的类型必须时「字符串」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
-        }
+            ObjString* removeString = argCount ? flattenString(peek(argCount - 1)) : NULL;
+            wchar_t* chars = wideString(string);
+            wchar_t* remove = removeString != NULL ? wideString(removeString) : NULL;
+            const wchar_t* str = chars;
+            const wchar_t* end;
+            size_t res_size;
 
-        wchar_t* remove = argCount ? AS_STRING(peek(argCount - 1))->chars : NULL;
-        const wchar_t* end;
-        size_t res_size;
+            end = str + wcslen(str) - 1;
+            while(end > str && containsChar(remove, (wchar_t)*end)) end--;
+            end++;
 
-        end = str + wcslen(str) - 1;
-        while(end > str && containsChar(remove, (wchar_t)*end)) end--;
-        end++;
+            res_size = (end - str) < wcslen(str)-1 ? (end - str) : wcslen(str)-1;
+            ObjString* result = copyString(str, res_size);
 
-        res_size = (end - str) < wcslen(str)-1 ? (end - str) : wcslen(str)-1;
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(copyString(str, res_size)));
-        return true;
-    } else if (wcscmp(name->chars, L"大写") == 0) {
-        // Returns a string where all characters are in upper case.
-        ObjString* str = AS_STRING(*receiver);
-        if (argCount != 0) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
-            return false;
+            freeWideString(string, chars);
+            if (remove != NULL) freeWideString(removeString, remove);
+            vm.stackTop -= argCount + 1;
+            push(OBJ_VAL(result));
+            return true;
         }
+        case STRING_UPPER: {
+            // Returns a string where all characters are in upper case.
+            ObjString* str = flattenString(*receiver);
+            if (argCount != 0) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
+                return false;
+            }
 
-        wchar_t* chars = ALLOCATE(wchar_t, str->length + 1);
-        wcscpy(chars, str->chars);
-        chars[str->length + 1] = L'\0';
-        wchar_t* c = chars;
-        while (*c) {
-            *c = towupper(*c);
-            c++;
-        }
-        ObjString* result = takeString(chars, str->length + 1);
+            int width = 1;
+            for (int i = 0; i < str->length; i++) {
+                int charW = charWidth(towupper(charAt(str, i)));
+                if (charW > width) width = charW;
+            }
+            ObjString* result = allocateString(str->length, width);
+            for (int i = 0; i < str->length; i++) {
+                storeToString(result, i, towupper(charAt(str, i)));
+            }
+            result = internString(result);
 
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(result));
-        return true;
-    } else if (wcscmp(name->chars, L"小写") == 0) {
-        // Returns a string where all characters are in lower case.
-        ObjString* str = AS_STRING(*receiver);
-        if (argCount != 0) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
-            return false;
+            vm.stackTop -= argCount + 1;
+            push(OBJ_VAL(result));
+            return true;
         }
+        case STRING_LOWER: {
+            // Returns a string where all characters are in lower case.
+            ObjString* str = flattenString(*receiver);
+            if (argCount != 0) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
+                return false;
+            }
 
-        wchar_t* chars = ALLOCATE(wchar_t, str->length + 1);
-        wcscpy(chars, str->chars);
-        chars[str->length + 1] = L'\0';
-        wchar_t* c = chars;
-        while (*c) {
-            *c = towlower(*c);
-            c++;
-        }
-        ObjString* result = takeString(chars, str->length + 1);
+            int width = 1;
+            for (int i = 0; i < str->length; i++) {
+                int charW = charWidth(towlower(charAt(str, i)));
+                if (charW > width) width = charW;
+            }
+            ObjString* result = allocateString(str->length, width);
+            for (int i = 0; i < str->length; i++) {
+                storeToString(result, i, towlower(charAt(str, i)));
+            }
+            result = internString(result);
 
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(result));
-        return true;
-    } else if (wcscmp(name->chars, L"子串") == 0) {
-        // Returns a part of a string between given indexes
-        if (argCount != 2) {
-            frame->ip = ip;
-            runtimeError(L"需要 2 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (!IS_NUMBER(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（开头）的类型必须时「数字」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
-        } else if (!IS_NUMBER(peek(argCount - 2))) {
-            frame->ip = ip;
-            runtimeError(L"参数 2（结尾）的类型必须时「数字」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
+            vm.stackTop -= argCount + 1;
+            push(OBJ_VAL(result));
+            return true;
         }
+        case STRING_SUBSTRING: {
+            // Returns a part of a string between given indexes
+            if (argCount != 2) {
+                frame->ip = ip;
+                runtimeError(L"需要 2 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (!IS_NUMBER(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（开头）的类型必须时「数字」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            } else if (!IS_NUMBER(peek(argCount - 2))) {
+                frame->ip = ip;
+                runtimeError(L"参数 2（结尾）的类型必须时「数字」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        ObjString* str = AS_STRING(*receiver);
-        int begin = AS_NUMBER(peek(argCount - 1));
-        int end = AS_NUMBER(peek(argCount - 2));
-        if (begin < 0) begin = str->length + begin;
-        if (end < 0) end = str->length + end;
+            ObjString* str = flattenString(*receiver);
+            int begin = AS_NUMBER(peek(argCount - 1));
+            int end = AS_NUMBER(peek(argCount - 2));
+            if (begin < 0) begin = str->length + begin;
+            if (end < 0) end = str->length + end;
 
-        if (!isValidStringIndex(str, begin)) {
-            frame->ip = ip;
-            runtimeError(L"参数 1 不是有效索引。");
-            return false;
-        } else if (!isValidStringIndex(str, end - 1)) { // Ending index is exclusive
-            frame->ip = ip;
-            runtimeError(L"参数 2 不是有效索引。");
-            return false;
-        } else if (end < begin) {
-            frame->ip = ip;
-            runtimeError(L"结束索引不能在开始索引之前。");
-            return false;
-        }
+            if (!isValidStringIndex(str, begin)) {
+                frame->ip = ip;
+                runtimeError(L"参数 1 不是有效索引。");
+                return false;
+            } else if (!isValidStringIndex(str, end - 1)) { // Ending index is exclusive
+                frame->ip = ip;
+                runtimeError(L"参数 2 不是有效索引。");
+                return false;
+            } else if (end < begin) {
+                frame->ip = ip;
+                runtimeError(L"结束索引不能在开始索引之前。");
+                return false;
+            }
 
-        wchar_t* chars = ALLOCATE(wchar_t, end - begin + 1);
-        memcpy( chars, &str->chars[begin], (end - begin) * sizeof(wchar_t) );
-        chars[end - begin] = L'\0';
-        ObjString* result = takeString(chars, end - begin + 1);
+            ObjString* result = sliceString(str, begin, end);
 
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(result));
-        return true;
+            vm.stackTop -= argCount + 1;
+            push(OBJ_VAL(result));
+            return true;
+        }
     }
-    frame->ip = ip;
-    runtimeError(L"未定义的属性「%ls」。", name->chars);
+
+    // Unreachable.
     return false;
 }
 
 static bool invokeList(const Value* receiver, ObjString* name, int argCount, CallFrame* frame, uint8_t* ip) {
-    if (wcscmp(name->chars, L"推") == 0) {
-        // Push a value to the end of a list increasing the list's length by 1
-        if (argCount != 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
-            return false;
-        }
-        ObjList *list = AS_LIST(*receiver);
-        Value item = peek(argCount - 1);
-        insertToList(list, item, list->count);
-        vm.stackTop -= argCount + 1;
-        push(NIL_VAL);
-        return true;
-    } else if (wcscmp(name->chars, L"弹") == 0) {
-        // Pop a value from the end of a list decreasing the list's length by 1
-        if (argCount != 0) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
-            return false;
-        }
-
-        ObjList *list = AS_LIST(*receiver);
+    Value selector;
+    if (!tableGet(&vm.listMethods, name, &selector)) {
+        frame->ip = ip;
+        stringError(L"未定义的属性「%ls」。", name);
+        return false;
+    }
 
-        if (!isValidListIndex(list, list->count - 1)) {
-            frame->ip = ip;
-            runtimeError(L"无法从空列表中弹出。");
-            return false;
+    switch ((int)AS_NUMBER(selector)) {
+        case LIST_PUSH: {
+            // Push a value to the end of a list increasing the list's length by 1
+            if (argCount != 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
+                return false;
+            }
+            ObjList *list = AS_LIST(*receiver);
+            Value item = peek(argCount - 1);
+            insertToList(list, item, list->count);
+            vm.stackTop -= argCount + 1;
+            push(NIL_VAL);
+            return true;
         }
+        case LIST_POP: {
+            // Pop a value from the end of a list decreasing the list's length by 1
+            if (argCount != 0) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
+                return false;
+            }
 
-        deleteFromList(list, list->count - 1);
-        vm.stackTop -= argCount + 1;
-        push(NIL_VAL);
-        return true;
-    } else if (wcscmp(name->chars, L"插") == 0) {
-        // Insert a value to the specified index of a list increasing the list's length by 1
-        if (argCount != 2) {
-            frame->ip = ip;
-            runtimeError(L"需要 2 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (!IS_NUMBER(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（索引）的类型必须时「数字」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
-        }
+            ObjList *list = AS_LIST(*receiver);
 
-        ObjList *list = AS_LIST(*receiver);
-        int index = AS_NUMBER(peek(argCount - 1));
-        if (index < 0) index = list->count + index;
-        Value item = peek(argCount - 2);
+            if (!isValidListIndex(list, list->count - 1)) {
+                frame->ip = ip;
+                runtimeError(L"无法从空列表中弹出。");
+                return false;
+            }
 
-        if (!isValidListIndex(list, index)) {
-            frame->ip = ip;
-            runtimeError(L"参数 1 不是有效索引");
-            return false;
+            deleteFromList(list, list->count - 1);
+            vm.stackTop -= argCount + 1;
+            push(NIL_VAL);
+            return true;
         }
+        case LIST_INSERT: {
+            // Insert a value to the specified index of a list increasing the list's length by 1
+            if (argCount != 2) {
+                frame->ip = ip;
+                runtimeError(L"需要 2 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (!IS_NUMBER(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（索引）的类型必须时「数字」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        insertToList(list, item, index);
-        vm.stackTop -= argCount + 1;
-        push(NIL_VAL);
-        return true;
-    } else if (wcscmp(name->chars, L"删") == 0) {
-        // Delete an item from a list at the given index.
-        if (argCount != 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (!IS_NUMBER(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（索引）的类型必须时「数字」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
-        }
+            ObjList *list = AS_LIST(*receiver);
+            int index = AS_NUMBER(peek(argCount - 1));
+            if (index < 0) index = list->count + index;
+            Value item = peek(argCount - 2);
 
-        ObjList* list = AS_LIST(*receiver);
-        int index = AS_NUMBER(peek(argCount - 1));
-        if (index < 0) index = list->count + index;
+            if (!isValidListIndex(list, index)) {
+                frame->ip = ip;
+                runtimeError(L"参数 1 不是有效索引");
+                return false;
+            }
 
-        if (!isValidListIndex(list, index)) {
-            frame->ip = ip;
-            runtimeError(L"参数 1 不是有效索引。");
-            return false;
+            insertToList(list, item, index);
+            vm.stackTop -= argCount + 1;
+            push(NIL_VAL);
+            return true;
         }
+        case LIST_DELETE: {
+            // Delete an item from a list at the given index.
+            if (argCount != 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (!IS_NUMBER(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（索引）的类型必须时「数字」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        deleteFromList(list, index);
-        vm.stackTop -= argCount + 1;
-        push(NIL_VAL);
-        return true;
-    } else if (wcscmp(name->chars, L"长度") == 0) {
-        // Returns the length of the list
-        if (argCount != 0) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
-            return false;
+            ObjList* list = AS_LIST(*receiver);
+            int index = AS_NUMBER(peek(argCount - 1));
+            if (index < 0) index = list->count + index;
+
+            if (!isValidListIndex(list, index)) {
+                frame->ip = ip;
+                runtimeError(L"参数 1 不是有效索引。");
+                return false;
+            }
+
+            deleteFromList(list, index);
+            vm.stackTop -= argCount + 1;
+            push(NIL_VAL);
+            return true;
         }
-        vm.stackTop -= argCount + 1;
-        push(NUMBER_VAL(AS_LIST(*receiver)->count));
-        return true;
-    } else if (wcscmp(name->chars, L"过滤") == 0) {
-        // Filters the list based on the given function
-        if (argCount != 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (!IS_CLOSURE(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（测试）的类型必须时「关闭」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
+        case LIST_LENGTH: {
+            // Returns the length of the list
+            if (argCount != 0) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
+                return false;
+            }
+            vm.stackTop -= argCount + 1;
+            push(NUMBER_VAL(AS_LIST(*receiver)->count));
+            return true;
         }
+        case LIST_FILTER: {
+            // Filters the list based on the given function
+            if (argCount != 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (!IS_CLOSURE(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（测试）的类型必须时「关闭」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
 
-        ObjList* list = AS_LIST(*receiver);
-        ObjList* filtered = newList();
-        ObjClosure* closure = AS_CLOSURE(peek(argCount - 1));
+            ObjList* list = AS_LIST(*receiver);
+            ObjList* filtered = newList();
+            ObjClosure* closure = AS_CLOSURE(peek(argCount - 1));
 
-        if (closure->function->arity != 1) {
-            frame->ip = ip;
-            runtimeError(L"输入功能需要 1 个参数，但得到 %d。", argCount);
-            return false;
-        }
-        for (int i = 0; i < list->count; i++) {
-            Value ret;
-            Value argArr[1] = {indexFromList(list, i)};
-            if (runClosure(closure, &ret, argArr, 1) != INTERPRET_OK) {
+            if (closure->function->arity != 1) {
+                frame->ip = ip;
+                runtimeError(L"输入功能需要 1 个参数，但得到 %d。", argCount);
                 return false;
             }
-            if (!isFalsey(ret)) insertToList(filtered, indexFromList(list, i), filtered->count);
-        }
+            for (int i = 0; i < list->count; i++) {
+                Value ret;
+                Value argArr[1] = {indexFromList(list, i)};
+                if (runClosure(closure, &ret, argArr, 1) != INTERPRET_OK) {
+                    return false;
+                }
+                if (!isFalsey(ret)) insertToList(filtered, indexFromList(list, i), filtered->count);
+            }
 
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(filtered));
-        return true;
-    } else if (wcscmp(name->chars, L"排序") == 0) {
-        // Sorts the list based on the given function or in ascending order
-        if (argCount > 1) {
-            frame->ip = ip;
-            runtimeError(L"需要 0 或 1 个参数，但得到 %d。", argCount);
-            return false;
-        } else if (argCount == 1 && !IS_CLOSURE(peek(argCount - 1))) {
-            frame->ip = ip;
-            runtimeError(L"参数 1（测试）的类型必须时「关闭」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
-            return false;
+            vm.stackTop -= argCount + 1;
+            push(OBJ_VAL(filtered));
+            return true;
         }
+        case LIST_SORT: {
+            // Sorts the list based on the given function or in ascending order
+            if (argCount > 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 或 1 个参数，但得到 %d。", argCount);
+                return false;
+            } else if (argCount == 1 && !IS_CLOSURE(peek(argCount - 1))) {
+                frame->ip = ip;
+                runtimeError(L"参数 1（测试）的类型必须时「关闭」，而不是「%ls」。", getType(vm.stackTop[-argCount]));
+                return false;
+            }
 
-        ObjList* list = AS_LIST(*receiver);
-        ObjClosure* closure = argCount == 1 ? AS_CLOSURE(peek(argCount - 1)) : NULL;
+            ObjList* list = AS_LIST(*receiver);
+            ObjClosure* closure = argCount == 1 ? AS_CLOSURE(peek(argCount - 1)) : NULL;
 
-        if (closure && closure->function->arity != 2) {
-            frame->ip = ip;
-            runtimeError(L"输入功能需要 2 个参数，但得到 %d。", argCount);
-            return false;
+            if (closure && closure->function->arity != 2) {
+                frame->ip = ip;
+                runtimeError(L"输入功能需要 2 个参数，但得到 %d。", argCount);
+                return false;
+            }
+
+            if (!sortList(list, 0, list->count - 1, closure))
+                return false;
+
+            vm.stackTop -= argCount + 1;
+            push(OBJ_VAL(list));
+            return true;
         }
+    }
 
-        if (!sortList(list, 0, list->count - 1, closure))
-            return false;
+    // Unreachable.
+    return false;
+}
 
-        vm.stackTop -= argCount + 1;
-        push(OBJ_VAL(list));
-        return true;
+static bool invokeMap(const Value* receiver, ObjString* name, int argCount, CallFrame* frame, uint8_t* ip) {
+    Value selector;
+    if (!tableGet(&vm.mapMethods, name, &selector)) {
+        frame->ip = ip;
+        stringError(L"未定义的属性「%ls」。", name);
+        return false;
     }
 
-    frame->ip = ip;
-    runtimeError(L"未定义的属性「%ls」。", name->chars);
+    ObjMap* map = AS_MAP(*receiver);
+    switch ((int)AS_NUMBER(selector)) {
+        case MAP_LENGTH: {
+            // Returns the number of keys in the map
+            if (argCount != 0) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
+                return false;
+            }
+            vm.stackTop -= argCount + 1;
+            push(NUMBER_VAL(map->count));
+            return true;
+        }
+        case MAP_KEYS:
+        case MAP_VALUES: {
+            // Returns a list of the map's keys or values, in the order the keys were added
+            if (argCount != 0) {
+                frame->ip = ip;
+                runtimeError(L"需要 0 个参数，但得到 %d。", argCount);
+                return false;
+            }
+            bool keys = (int)AS_NUMBER(selector) == MAP_KEYS;
+            ObjList* list = newList();
+            push(OBJ_VAL(list));
+            for (int i = 0; i < map->used; i++) {
+                MapEntry* entry = &map->entries[i];
+                if (IS_UNDEFINED(entry->key)) continue;
+                insertToList(list, keys ? entry->key : entry->value, list->count);
+            }
+            vm.stackTop -= argCount + 2;
+            push(OBJ_VAL(list));
+            return true;
+        }
+        case MAP_HAS: {
+            // Returns whether the map has the given key
+            if (argCount != 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
+                return false;
+            }
+            Value value;
+            bool found = mapGet(map, peek(0), &value);
+            vm.stackTop -= argCount + 1;
+            push(BOOL_VAL(found));
+            return true;
+        }
+        case MAP_DELETE: {
+            // Removes the given key and its value from the map, if it is there
+            if (argCount != 1) {
+                frame->ip = ip;
+                runtimeError(L"需要 1 个参数，但得到 %d。", argCount);
+                return false;
+            }
+            mapDelete(map, peek(0));
+            vm.stackTop -= argCount + 1;
+            push(NIL_VAL);
+            return true;
+        }
+    }
+
+    // Unreachable.
     return false;
 }
 
-static bool invoke(ObjString* name, int argCount, CallFrame* frame, uint8_t* ip) {
+static bool invoke(ObjString* name, int argCount, InlineCache* cache, CallFrame* frame, uint8_t* ip) {
     Value receiver = peek(argCount);
 
     if (IS_INSTANCE(receiver)) {
-        return invokeInstance(&receiver, name, argCount, frame, ip);
+        return invokeInstance(&receiver, name, argCount, cache, frame, ip);
     } else if (IS_STRING(receiver)) {
         return invokeString(&receiver, name, argCount, frame, ip);
     } else if (IS_LIST(receiver)) {
         return invokeList(&receiver, name, argCount, frame, ip);
+    } else if (IS_MAP(receiver)) {
+        return invokeMap(&receiver, name, argCount, frame, ip);
     }
 
     frame->ip = ip;
-    runtimeError(L"只有实例、字符串和列表有方法。");
+    runtimeError(L"只有实例、字符串、列表和映射有方法。");
     return false;
 }
 
+static bool superInvoke(ObjString* name, int argCount, InlineCache* cache, CallFrame* frame, uint8_t* ip) {
+    ObjClass *superclass = AS_CLASS(pop());
+    Value cached;
+    if (findCachedMethod(cache, (Obj*)superclass, superclass, &cached)) {
+        return callMethod(cached, false, argCount);
+    }
+    return invokeFromClass(superclass, false, name, argCount, cache, (Obj*)superclass, frame, ip);
+}
+
+// Instances of a class that gain their fields in the same order share a
+// shape, so a site only has to compare the instance's shape with the one it
+// saw last to know which slot holds the field.
+static inline bool getCachedField(ObjInstance* instance, ObjString* name, InlineCache* cache, Value* value) {
+    if (instance->shape == cache->shape && cache->transition == NULL) {
+        COUNT_CACHE(propertyCacheHits);
+        *value = instance->fields[cache->slot];
+        return true;
+    }
+
+    COUNT_CACHE(propertyCacheMisses);
+    int slot = findShapeSlot(instance->shape, name);
+    if (slot == -1) return false;
+
+    cache->shape = instance->shape;
+    cache->transition = NULL;
+    cache->slot = slot;
+    cacheBarrier(OBJ_VAL(instance->shape));
+    *value = instance->fields[slot];
+    return true;
+}
+
+static inline void setCachedField(ObjInstance* instance, ObjString* name, InlineCache* cache, Value value) {
+    if (instance->shape == cache->shape) {
+        COUNT_CACHE(propertyCacheHits);
+        if (cache->transition == NULL) {
+            instance->fields[cache->slot] = value;
+            writeBarrier(&instance->obj, value);
+        } else {
+            addInstanceField(instance, cache->transition, value);
+        }
+        return;
+    }
+
+    COUNT_CACHE(propertyCacheMisses);
+    ObjShape* shape = instance->shape;
+    int slot = findShapeSlot(shape, name);
+    if (slot != -1) {
+        instance->fields[slot] = value;
+        writeBarrier(&instance->obj, value);
+        cache->shape = shape;
+        cache->transition = NULL;
+        cache->slot = slot;
+        cacheBarrier(OBJ_VAL(shape));
+        return;
+    }
+
+    ObjShape* next = shapeTransition(shape, name);
+    addInstanceField(instance, next, value);
+    cache->shape = shape;
+    cache->transition = next;
+    cache->slot = next->slotCount - 1;
+    cacheBarrier(OBJ_VAL(shape));
+    cacheBarrier(OBJ_VAL(next));
+}
+
 static bool bindMethod(ObjClass* klass, ObjString* name, CallFrame* frame, uint8_t* ip) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
         frame->ip = ip;
-        runtimeError(L"未定义的属性「%ls」。", name->chars);
+        stringError(L"未定义的属性「%ls」。", name);
         return false;
     }
     ObjBoundMethod* bound;
@@ -719,6 +1173,47 @@ static bool bindMethod(ObjClass* klass, ObjString* name, CallFrame* frame, uint8
     return true;
 }
 
+static inline bool getProperty(CallFrame* frame, uint8_t* ip, uint8_t constant) {
+    if (!IS_INSTANCE(peek(0))) {
+        frame->ip = ip;
+        runtimeError(L"只有实例有属性。");
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    ObjString *name = AS_STRING(frame->closure->function->chunk.constants.values[constant]);
+
+    Value value;
+    if (getCachedField(instance, name, &frame->closure->function->chunk.caches[constant], &value)) {
+        pop(); // Instance.
+        push(value);
+        return true;
+    }
+
+    return bindMethod(instance->klass, name, frame, ip);
+}
+
+static inline bool setProperty(CallFrame* frame, uint8_t* ip, uint8_t constant) {
+    if (!IS_INSTANCE(peek(1))) {
+        frame->ip = ip;
+        runtimeError(L"只有实例有字段。");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    if (instance->isStatic) {
+        frame->ip = ip;
+        runtimeError(L"不能修改常量属性。");
+        return false;
+    }
+
+    ObjString *name = AS_STRING(frame->closure->function->chunk.constants.values[constant]);
+    setCachedField(instance, name, &frame->closure->function->chunk.caches[constant], peek(0));
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
 static ObjUpvalue* captureUpvalue(Value* local) {
     ObjUpvalue* prevUpvalue = NULL;
     ObjUpvalue* upvalue = vm.openUpvalues;
@@ -747,26 +1242,264 @@ static void closeUpvalues(const Value* last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier(&upvalue->obj, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
 
+// Runs a call in tail position in the caller's own frame, which it no longer
+// needs, so tail recursion doesn't use up frames.
+static bool tailCall(ObjClosure* closure, int argCount) {
+    if (argCount != closure->function->arity) {
+        runtimeError(L"需要 %d 个参数，但得到 %d。", closure->function->arity, argCount);
+        return false;
+    }
+
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+#ifdef BASELINE_JIT
+    warmUp(closure->function);
+#endif
+    return true;
+}
+
 static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    if (name == vm.initString) klass->initializer = method;
+    writeBarrier(&klass->obj, OBJ_VAL(name));
+    writeBarrier(&klass->obj, method);
+    klass->methodEpoch++;
     pop();
 }
 
-static ObjString* concatenate(ObjString* a, ObjString* b) {
-    int length = a->length + b->length;
-    wchar_t* chars = ALLOCATE(wchar_t, length + 1);
-    memcpy(chars, a->chars, a->length * sizeof(wchar_t));
-    memcpy(chars + a->length, b->chars, b->length * sizeof(wchar_t));
-    chars[length] = L'\0';
+static bool inherit(CallFrame* frame, uint8_t* ip) {
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        frame->ip = ip;
+        runtimeError(L"超类必须是个类。");
+        return false;
+    }
+    ObjClass *subclass = AS_CLASS(peek(0));
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    subclass->initializer = AS_CLASS(superclass)->initializer;
+    rescanObject(&subclass->obj);
+    subclass->methodEpoch++;
+    pop(); // Subclass.
+    return true;
+}
 
-    ObjString* result = takeString(chars, length);
-    return result;
+// Reads OP_CLOSURE's operands starting at ip and returns where they end.
+static uint8_t* makeClosure(CallFrame* frame, uint8_t* ip) {
+    ObjFunction *function = AS_FUNCTION(frame->closure->function->chunk.constants.values[*ip++]);
+    ObjClosure *closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = *ip++;
+        uint8_t index = *ip++;
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        // Capturing an upvalue allocates, which may have promoted closure.
+        writeBarrier(&closure->obj, OBJ_VAL(closure->upvalues[i]));
+    }
+    return ip;
+}
+
+static void buildList(int itemCount) {
+    // Stack before: [item1, item2, ..., itemN] and after: [list]
+    ObjList* list = newList();
+
+    // Add items to list
+    push(OBJ_VAL(list)); // So list isn't sweeped by GC in insertToList
+    for (int i = itemCount; i > 0; i--) {
+        insertToList(list, peek(i), list->count);
+    }
+    pop();
+
+    // Pop items from stack
+    while (itemCount-- > 0) {
+        pop();
+    }
+
+    push(OBJ_VAL(list));
+}
+
+// NaN equals nothing, itself included, so it can't be a key.
+static bool isValidMapKey(Value key) {
+    return !IS_NUMBER(key) || !isnan(AS_NUMBER(key));
+}
+
+// Kept out of run(), which map literals are too rare to grow for.
+static __attribute__((noinline)) bool buildMap(int entryCount, CallFrame* frame, uint8_t* ip) {
+    // Stack before: [key1, value1, ..., keyN, valueN] and after: [map]
+    ObjMap* map = newMap();
+
+    push(OBJ_VAL(map)); // So map isn't sweeped by GC in mapSet
+    for (int i = entryCount * 2; i > 0; i -= 2) {
+        if (!isValidMapKey(peek(i))) {
+            frame->ip = ip;
+            runtimeError(L"映射键不能是 NaN。");
+            return false;
+        }
+        mapSet(map, peek(i), peek(i - 1));
+    }
+    pop();
+
+    vm.stackTop -= entryCount * 2;
+    push(OBJ_VAL(map));
+    return true;
+}
+
+static bool indexSubscript(CallFrame* frame, uint8_t* ip) {
+    // Stack before: [list, index] and after: [index(list, index)]. They stay
+    // on the stack until the result is found, since flattening a
+    // concatenation can collect.
+    Value index = peek(0);
+    Value obj = peek(1);
+
+    if (IS_STRING(obj)) {
+        ObjString *objString = flattenString(obj);
+
+        if (!IS_NUMBER(index)) {
+            frame->ip = ip;
+            runtimeError(L"字符串索引不是数字。");
+            return false;
+        }
+        int numIndex = AS_NUMBER(index);
+        if (numIndex < 0) numIndex = objString->length + numIndex;
+
+        if (!isValidStringIndex(objString, numIndex)) {
+            frame->ip = ip;
+            runtimeError(L"字符串索引超出范围。");
+            return false;
+        }
+        wchar_t result = indexFromString(objString, numIndex);
+        ObjString* character = copyString(&result, 1);
+        vm.stackTop -= 2;
+        push(OBJ_VAL(character));
+        return true;
+    } else if (IS_LIST(obj)) {
+        ObjList *objList = AS_LIST(obj);
+
+        if (!IS_NUMBER(index)) {
+            frame->ip = ip;
+            runtimeError(L"列表索引不是数字。");
+            return false;
+        }
+        int numIndex = AS_NUMBER(index);
+        if (numIndex < 0) numIndex = objList->count + numIndex;
+
+        if (!isValidListIndex(objList, numIndex)) {
+            frame->ip = ip;
+            runtimeError(L"列表索引超出范围。");
+            return false;
+        }
+
+        Value result = indexFromList(objList, numIndex);
+        vm.stackTop -= 2;
+        push(result);
+        return true;
+    } else if (IS_MAP(obj)) {
+        Value result;
+        if (!mapGet(AS_MAP(obj), index, &result)) {
+            frame->ip = ip;
+            runtimeError(L"映射中没有这个键。");
+            return false;
+        }
+        vm.stackTop -= 2;
+        push(result);
+        return true;
+    }
+
+    frame->ip = ip;
+    runtimeError(L"无效类型索引到。");
+    return false;
+}
+
+static bool storeSubscript(CallFrame* frame, uint8_t* ip) {
+    // Stack before: [list, index, item] and after: [item]. They stay on the
+    // stack until the item is in, since growing a map can collect.
+    Value item = peek(0);
+    Value index = peek(1);
+    Value obj = peek(2);
+
+    if (IS_STRING(obj)) {
+        ObjString* objString = flattenString(obj);
+
+        if (!IS_NUMBER(index)) {
+            frame->ip = ip;
+            runtimeError(L"字符串索引不是数字。");
+            return false;
+        } else if (!IS_STRING(item)) {
+            frame->ip = ip;
+            runtimeError(L"字符串中只能存储字符。");
+            return false;
+        }
+
+        ObjString* itemString = flattenString(item);
+        int numIndex = AS_NUMBER(index);
+        if (numIndex < 0) numIndex = objString->length + numIndex;
+
+        if (!isValidStringIndex(objString, numIndex)) {
+            frame->ip = ip;
+            runtimeError(L"字符串索引无效。");
+            return false;
+        } else if (itemString->length != 1) {
+            frame->ip = ip;
+            runtimeError(
+                    L"期望长度为 1 的字符串，但长度为 %d。", itemString->length);
+            return false;
+        }
+
+        storeToString(objString, numIndex, charAt(itemString, 0));
+        vm.stackTop -= 3;
+        push(item);
+        return true;
+    } else if (IS_LIST(obj)) {
+        ObjList *objList = AS_LIST(obj);
+
+        if (!IS_NUMBER(index)) {
+            frame->ip = ip;
+            runtimeError(L"列表索引不是数字。");
+            return false;
+        }
+        int numIndex = AS_NUMBER(index);
+        if (numIndex < 0) numIndex = objList->count + numIndex;
+
+        if (!isValidListIndex(objList, numIndex)) {
+            frame->ip = ip;
+            runtimeError(L"列表索引无效。");
+            return false;
+        }
+
+        storeToList(objList, numIndex, item);
+        vm.stackTop -= 3;
+        push(item);
+        return true;
+    } else if (IS_MAP(obj)) {
+        if (!isValidMapKey(index)) {
+            frame->ip = ip;
+            runtimeError(L"映射键不能是 NaN。");
+            return false;
+        }
+
+        mapSet(AS_MAP(obj), index, item);
+        vm.stackTop -= 3;
+        push(item);
+        return true;
+    }
+
+    frame->ip = ip;
+    runtimeError(L"无法存储值：变量不是字符串、列表或映射。");
+    return false;
 }
 
 static InterpretResult run() {
@@ -782,6 +1515,8 @@ static InterpretResult run() {
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+
+#define CACHE_AT(constant) (&frame->closure->function->chunk.caches[constant])
 #define BINARY_OP(valueType, op) \
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -793,6 +1528,23 @@ static InterpretResult run() {
       double a = AS_NUMBER(pop()); \
       push(valueType(a op b)); \
     } while (false)
+// Rewrites the instruction being executed into its specialized form.
+#define QUICKEN(opcode) (ip[-1] = (opcode))
+
+// Runs a specialized number instruction, or turns it back into its generic
+// form and re-executes that when an operand is not a number.
+#define BINARY_NUM_OP(valueType, op, generic) \
+    do { \
+      Value b = peek(0); \
+      Value a = peek(1); \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        ip[-1] = (generic); \
+        ip--; \
+        DISPATCH(); \
+      } \
+      vm.stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+      vm.stackTop--; \
+    } while (false)
 #define BINARY_BITWISE_OP(valueType, op) \
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -816,487 +1568,825 @@ static InterpretResult run() {
       push(valueType(op(a, b))); \
     } while (false)
 
-    for(;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        wprintf(L"          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            wprintf(L"[ ");
-            printValue(*slot);
-            wprintf(L" ]");
-        }
-        wprintf(L"\n");
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int) (frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+      wprintf(L"          "); \
+      for (Value *slot = vm.stack; slot < vm.stackTop; slot++) { \
+        wprintf(L"[ "); \
+        printValue(*slot); \
+        wprintf(L" ]"); \
+      } \
+      wprintf(L"\n"); \
+      disassembleInstruction(&frame->closure->function->chunk, \
+                             (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
-        switch (READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_POP:
-                pop();
-                break;
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    frame->ip = ip;
-                    runtimeError(L"未定义的变量「%ls」。", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
 
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    frame->ip = ip;
-                    runtimeError(L"未定义的变量「%ls」。", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    frame->ip = ip;
-                    runtimeError(L"只有实例有属性。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
-
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
+#ifdef DEBUG_OPCODE_NGRAMS
+#define PROFILE_INSTRUCTION() recordOpcode(*ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
 
-                if (!bindMethod(instance->klass, name, frame, ip)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    frame->ip = ip;
-                    runtimeError(L"只有实例有字段。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+#ifdef BASELINE_JIT
+// Runs the frame on top in its compiled code, if it has any, for as long as
+// the frames it returns into are compiled too.
+#define ENTER_JIT() \
+    do { \
+      while (frame->closure->function->jit != NULL) { \
+        frame->ip = ip; \
+        JitResult result = jitRun(frame); \
+        if (result == JIT_ERROR) return INTERPRET_RUNTIME_ERROR; \
+        if (result == JIT_FINISHED) return INTERPRET_OK; \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->ip; \
+      } \
+    } while (false)
+// A loop that gets the function compiled continues in the compiled code
+// right at its header.
+#define HOT_LOOP() \
+    do { \
+      warmUp(frame->closure->function); \
+      ENTER_JIT(); \
+    } while (false)
+#else
+#define ENTER_JIT() do { } while (false)
+#define HOT_LOOP() do { } while (false)
+#endif
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                if (instance->isStatic) {
-                    frame->ip = ip;
-                    runtimeError(L"不能修改常量属性。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+#ifdef COMPUTED_GOTO
+    // With computed gotos every handler ends in its own indirect jump, so the
+    // branch predictor gets a separate history for each opcode instead of
+    // sharing the single jump at the top of the switch.
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&code_OP_CONSTANT,
+        [OP_NIL] = &&code_OP_NIL,
+        [OP_TRUE] = &&code_OP_TRUE,
+        [OP_FALSE] = &&code_OP_FALSE,
+        [OP_POP] = &&code_OP_POP,
+        [OP_GET_LOCAL] = &&code_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&code_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&code_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&code_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&code_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&code_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&code_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&code_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&code_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&code_OP_GET_SUPER,
+        [OP_BUILD_LIST] = &&code_OP_BUILD_LIST,
+        [OP_BUILD_MAP] = &&code_OP_BUILD_MAP,
+        [OP_INDEX_SUBSCR] = &&code_OP_INDEX_SUBSCR,
+        [OP_STORE_SUBSCR] = &&code_OP_STORE_SUBSCR,
+        [OP_EQUAL] = &&code_OP_EQUAL,
+        [OP_GREATER] = &&code_OP_GREATER,
+        [OP_LESS] = &&code_OP_LESS,
+        [OP_ADD] = &&code_OP_ADD,
+        [OP_SUBTRACT] = &&code_OP_SUBTRACT,
+        [OP_BITWISE_NOT] = &&code_OP_BITWISE_NOT,
+        [OP_BITWISE_OR] = &&code_OP_BITWISE_OR,
+        [OP_BITWISE_XOR] = &&code_OP_BITWISE_XOR,
+        [OP_BITWISE_AND] = &&code_OP_BITWISE_AND,
+        [OP_BITWISE_LEFT_SHIFT] = &&code_OP_BITWISE_LEFT_SHIFT,
+        [OP_BITWISE_RIGHT_SHIFT] = &&code_OP_BITWISE_RIGHT_SHIFT,
+        [OP_INCREMENT] = &&code_OP_INCREMENT,
+        [OP_DECREMENT] = &&code_OP_DECREMENT,
+        [OP_MULTIPLY] = &&code_OP_MULTIPLY,
+        [OP_DIVIDE] = &&code_OP_DIVIDE,
+        [OP_MODULO] = &&code_OP_MODULO,
+        [OP_NOT] = &&code_OP_NOT,
+        [OP_NEGATE] = &&code_OP_NEGATE,
+        [OP_JUMP] = &&code_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&code_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&code_OP_LOOP,
+        [OP_CALL] = &&code_OP_CALL,
+        [OP_TAIL_CALL] = &&code_OP_TAIL_CALL,
+        [OP_INVOKE] = &&code_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&code_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&code_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&code_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&code_OP_RETURN,
+        [OP_CLASS] = &&code_OP_CLASS,
+        [OP_INHERIT] = &&code_OP_INHERIT,
+        [OP_METHOD] = &&code_OP_METHOD,
+        [OP_DUP] = &&code_OP_DUP,
+        [OP_DOUBLE_DUP] = &&code_OP_DOUBLE_DUP,
+        [OP_ADD_NUM] = &&code_OP_ADD_NUM,
+        [OP_LESS_NUM] = &&code_OP_LESS_NUM,
+        [OP_GREATER_NUM] = &&code_OP_GREATER_NUM,
+        [OP_GET_LOCAL_LOCAL] = &&code_OP_GET_LOCAL_LOCAL,
+        [OP_GET_LOCAL_CONSTANT_ADD] = &&code_OP_GET_LOCAL_CONSTANT_ADD,
+        [OP_LESS_JUMP_IF_FALSE] = &&code_OP_LESS_JUMP_IF_FALSE,
+        [OP_GET_THIS_PROPERTY] = &&code_OP_GET_THIS_PROPERTY,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(opcode)   code_##opcode
+#define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      switch (READ_BYTE())
+#define CASE(opcode)   case opcode
+#define DISPATCH()     goto loop
+#endif
 
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+    ENTER_JIT();
+    INTERPRET_LOOP {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            push(NIL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE):
+            push(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE):
+            push(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_POP):
+            pop();
+            DISPATCH();
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                frame->ip = ip;
+                stringError(L"未定义的变量「%ls」。", AS_STRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = peek(0);
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                frame->ip = ip;
+                stringError(L"未定义的变量「%ls」。", AS_STRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.globalValues.values[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = peek(0);
+            writeBarrier(&upvalue->obj, peek(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            uint8_t constant = READ_BYTE();
+            if (!getProperty(frame, ip, constant)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            uint8_t constant = READ_BYTE();
+            if (!setProperty(frame, ip, constant)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(pop());
 
-                if (!bindMethod(superclass, name, frame, ip)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_ADD:
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    ObjString* b = AS_STRING(peek(0));
-                    ObjString* a = AS_STRING(peek(1));
-                    ObjString* result = concatenate(a, b);
-                    pop();
-                    pop();
-                    push(OBJ_VAL(result));
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    frame->ip = ip;
-                    runtimeError(L"操作数必须是两个数字或两个字符串。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_MODULO:
-                BINARY_FUNC_OP(NUMBER_VAL, fmod);
-                break;
-            case OP_BITWISE_AND:
-                BINARY_BITWISE_OP(NUMBER_VAL, &);
-                break;
-            case OP_BITWISE_OR:
-                BINARY_BITWISE_OP(NUMBER_VAL, |);
-                break;
-            case OP_BITWISE_XOR:
-                BINARY_BITWISE_OP(NUMBER_VAL, ^);
-                break;
-            case OP_BITWISE_LEFT_SHIFT:
-                BINARY_BITWISE_OP(NUMBER_VAL, <<);
-                break;
-            case OP_BITWISE_RIGHT_SHIFT:
-                BINARY_BITWISE_OP(NUMBER_VAL, >>);
-                break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    frame->ip = ip;
-                    runtimeError(L"操作数必须是数字。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_BITWISE_NOT:
-                if (!IS_NUMBER(peek(0))) {
-                    frame->ip = ip;
-                    runtimeError(L"操作数必须是数字。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(~(int32_t)AS_NUMBER(pop())));
-                break;
-            case OP_INCREMENT: {
-                if (!IS_NUMBER(peek(0))) {
-                    frame->ip = ip;
-                    runtimeError(L"操作数必须是数字。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(AS_NUMBER(pop()) + 1));
-                break;
-            }
-            case OP_DECREMENT: {
-                if (!IS_NUMBER(peek(0))) {
-                    frame->ip = ip;
-                    runtimeError(L"操作数必须是数字。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(AS_NUMBER(pop()) - 1));
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) ip += offset;
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                ip -= offset;
-                break;
-            }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
+            if (!bindMethod(superclass, name, frame, ip)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER):
+            BINARY_OP(BOOL_VAL, >);
+            QUICKEN(OP_GREATER_NUM);
+            DISPATCH();
+        CASE(OP_LESS):
+            BINARY_OP(BOOL_VAL, <);
+            QUICKEN(OP_LESS_NUM);
+            DISPATCH();
+        CASE(OP_ADD):
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                Value result = concatenateStrings(peek(1), peek(0));
+                pop();
+                pop();
+                push(result);
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+                QUICKEN(OP_ADD_NUM);
+            } else {
                 frame->ip = ip;
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                runtimeError(L"操作数必须是两个数字或两个字符串。");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
+            DISPATCH();
+        CASE(OP_SUBTRACT):
+            BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY):
+            BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+        CASE(OP_DIVIDE):
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+        CASE(OP_MODULO):
+            BINARY_FUNC_OP(NUMBER_VAL, fmod);
+            DISPATCH();
+        CASE(OP_BITWISE_AND):
+            BINARY_BITWISE_OP(NUMBER_VAL, &);
+            DISPATCH();
+        CASE(OP_BITWISE_OR):
+            BINARY_BITWISE_OP(NUMBER_VAL, |);
+            DISPATCH();
+        CASE(OP_BITWISE_XOR):
+            BINARY_BITWISE_OP(NUMBER_VAL, ^);
+            DISPATCH();
+        CASE(OP_BITWISE_LEFT_SHIFT):
+            BINARY_BITWISE_OP(NUMBER_VAL, <<);
+            DISPATCH();
+        CASE(OP_BITWISE_RIGHT_SHIFT):
+            BINARY_BITWISE_OP(NUMBER_VAL, >>);
+            DISPATCH();
+        CASE(OP_NOT):
+            push(BOOL_VAL(isFalsey(pop())));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(peek(0))) {
                 frame->ip = ip;
-                if (!invoke(method, argCount, frame, ip)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                runtimeError(L"操作数必须是数字。");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        CASE(OP_BITWISE_NOT):
+            if (!IS_NUMBER(peek(0))) {
                 frame->ip = ip;
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, false, method, argCount, frame, ip)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
-            }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+                runtimeError(L"操作数必须是数字。");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(NUMBER_VAL(~(int32_t)AS_NUMBER(pop())));
+            DISPATCH();
+        CASE(OP_INCREMENT): {
+            if (!IS_NUMBER(peek(0))) {
+                frame->ip = ip;
+                runtimeError(L"操作数必须是数字。");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(NUMBER_VAL(AS_NUMBER(pop()) + 1));
+            DISPATCH();
+        }
+        CASE(OP_DECREMENT): {
+            if (!IS_NUMBER(peek(0))) {
+                frame->ip = ip;
+                runtimeError(L"操作数必须是数字。");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(NUMBER_VAL(AS_NUMBER(pop()) - 1));
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            HOT_LOOP();
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            if (!callValue(peek(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            Value callee = peek(argCount);
+            if (IS_CLOSURE(callee)) {
+                if (!tailCall(AS_CLOSURE(callee), argCount)) return INTERPRET_RUNTIME_ERROR;
+            } else if (!callValue(callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            uint8_t constant = READ_BYTE();
+            ObjString *method = AS_STRING(frame->closure->function->chunk.constants.values[constant]);
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            if (!invoke(method, argCount, CACHE_AT(constant), frame, ip)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            uint8_t constant = READ_BYTE();
+            ObjString *method = AS_STRING(frame->closure->function->chunk.constants.values[constant]);
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            if (!superInvoke(method, argCount, CACHE_AT(constant), frame, ip)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE):
+            ip = makeClosure(frame, ip);
+            DISPATCH();
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+            DISPATCH();
+        CASE(OP_RETURN): {
+            Value result = pop();
+            closeUpvalues(frame->slots);
+            vm.frameCount--;
+
+            if (vm.frameCount == 0) {
                 pop();
-                break;
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                } else if (frame->callClosure) {
-                    push(result);
-                    frame->callClosure = false;
-                    return INTERPRET_OK;
-                }
-
-                vm.stackTop = frame->slots;
+                return INTERPRET_OK;
+            } else if (frame->callClosure) {
                 push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
-            }
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    frame->ip = ip;
-                    runtimeError(L"超类必须是个类。");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
-            }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
-            case OP_DUP: push(peek(0)); break;
-            case OP_DOUBLE_DUP: push(peek(1)); push(peek(1)); break;
-            case OP_BUILD_LIST: {
-                // Stack before: [item1, item2, ..., itemN] and after: [list]
-                ObjList* list = newList();
-                uint8_t itemCount = READ_BYTE();
-
-                // Add items to list
-                push(OBJ_VAL(list)); // So list isn't sweeped by GC in insertToList
-                for (int i = itemCount; i > 0; i--) {
-                    insertToList(list, peek(i), list->count);
-                }
-                pop();
-
-                // Pop items from stack
-                while (itemCount-- > 0) {
-                    pop();
-                }
-
-                push(OBJ_VAL(list));
-                break;
-            }
-            case OP_INDEX_SUBSCR: {
-                // Stack before: [list, index] and after: [index(list, index)]
-                Value index = pop();
-                Value obj = pop();
-
-                if (IS_STRING(obj)) {
-                    ObjString *objString = AS_STRING(obj);
-
-                    if (!IS_NUMBER(index)) {
-                        frame->ip = ip;
-                        runtimeError(L"字符串索引不是数字。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    int numIndex = AS_NUMBER(index);
-                    if (numIndex < 0) numIndex = objString->length + numIndex;
-
-                    if (!isValidStringIndex(objString, numIndex)) {
-                        frame->ip = ip;
-                        runtimeError(L"字符串索引超出范围。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    wchar_t* result = ALLOCATE(wchar_t, 1);
-                    result[0] = indexFromString(objString, numIndex);
-                    push(OBJ_VAL(takeString(result, 1)));
-                    break;
-                } else if (IS_LIST(obj)) {
-                    ObjList *objList = AS_LIST(obj);
-
-                    if (!IS_NUMBER(index)) {
-                        frame->ip = ip;
-                        runtimeError(L"列表索引不是数字。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    int numIndex = AS_NUMBER(index);
-                    if (numIndex < 0) numIndex = objList->count + numIndex;
-
-                    if (!isValidListIndex(objList, numIndex)) {
-                        frame->ip = ip;
-                        runtimeError(L"列表索引超出范围。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    Value result = indexFromList(objList, numIndex);
-                    push(result);
-                    break;
-                }
+                frame->callClosure = false;
+                return INTERPRET_OK;
+            }
 
-                frame->ip = ip;
-                runtimeError(L"无效类型索引到。");
+            vm.stackTop = frame->slots;
+            push(result);
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CLASS):
+            push(OBJ_VAL(newClass(READ_STRING())));
+            DISPATCH();
+        CASE(OP_INHERIT):
+            if (!inherit(frame, ip)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_STORE_SUBSCR: {
-                // Stack before: [list, index, item] and after: [item]
-                Value item = pop();
-                Value index = pop();
-                Value obj = pop();
-
-                if (IS_STRING(obj)) {
-                    ObjString* objString = AS_STRING(obj);
-
-                    if (!IS_NUMBER(index)) {
-                        frame->ip = ip;
-                        runtimeError(L"字符串索引不是数字。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    } else if (!IS_STRING(item)) {
-                        frame->ip = ip;
-                        runtimeError(L"字符串中只能存储字符。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    ObjString* itemString = AS_STRING(item);
-                    int numIndex = AS_NUMBER(index);
-                    if (numIndex < 0) numIndex = objString->length + numIndex;
-
-                    if (!isValidStringIndex(objString, numIndex)) {
-                        frame->ip = ip;
-                        runtimeError(L"字符串索引无效。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    } else if (wcslen(itemString->chars) != 1) {
-                        frame->ip = ip;
-                        runtimeError(
-                                L"期望长度为 1 的字符串，但长度为 %d。", wcslen(itemString->chars));
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    storeToString(objString, numIndex, itemString->chars[0]);
-                    push(item);
-                    break;
-                } else if (IS_LIST(obj)) {
-                    ObjList *objList = AS_LIST(obj);
-
-                    if (!IS_NUMBER(index)) {
-                        frame->ip = ip;
-                        runtimeError(L"列表索引不是数字。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    int numIndex = AS_NUMBER(index);
-                    if (numIndex < 0) numIndex = objList->count + numIndex;
-
-                    if (!isValidListIndex(objList, numIndex)) {
-                        frame->ip = ip;
-                        runtimeError(L"列表索引无效。");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    storeToList(objList, numIndex, item);
-                    push(item);
-                    break;
-                }
-
+            DISPATCH();
+        CASE(OP_METHOD):
+            defineMethod(READ_STRING());
+            DISPATCH();
+        CASE(OP_DUP): push(peek(0)); DISPATCH();
+        CASE(OP_DOUBLE_DUP): push(peek(1)); push(peek(1)); DISPATCH();
+        CASE(OP_ADD_NUM):
+            BINARY_NUM_OP(NUMBER_VAL, +, OP_ADD);
+            DISPATCH();
+        CASE(OP_LESS_NUM):
+            BINARY_NUM_OP(BOOL_VAL, <, OP_LESS);
+            DISPATCH();
+        CASE(OP_GREATER_NUM):
+            BINARY_NUM_OP(BOOL_VAL, >, OP_GREATER);
+            DISPATCH();
+        CASE(OP_GET_LOCAL_LOCAL):
+            // OP_GET_LOCAL a, OP_GET_LOCAL b
+            push(frame->slots[ip[0]]);
+            push(frame->slots[ip[2]]);
+            ip += 3;
+            DISPATCH();
+        CASE(OP_GET_LOCAL_CONSTANT_ADD): {
+            // OP_GET_LOCAL a, OP_CONSTANT b, OP_ADD
+            Value a = frame->slots[ip[0]];
+            Value b = frame->closure->function->chunk.constants.values[ip[2]];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                ip += 4;
+            } else {
+                // Leave strings and errors to the unfused instructions.
+                push(a);
+                ip++;
+            }
+            DISPATCH();
+        }
+        CASE(OP_LESS_JUMP_IF_FALSE): {
+            // OP_LESS, OP_JUMP_IF_FALSE offset, OP_POP
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
                 frame->ip = ip;
-                runtimeError(L"无法存储值：变量不是字符串或列表。");
+                runtimeError(L"操作数必须是数字。");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            if (a < b) {
+                ip += 4;
+            } else {
+                // The jump target pops the condition.
+                push(FALSE_VAL);
+                ip += 3 + (uint16_t)((ip[1] << 8) | ip[2]);
+            }
+            DISPATCH();
+        }
+        CASE(OP_GET_THIS_PROPERTY): {
+            // OP_GET_LOCAL 0, OP_GET_PROPERTY name
+            Value receiver = frame->slots[0];
+            uint8_t constant = ip[2];
+            ObjString* name = AS_STRING(frame->closure->function->chunk.constants.values[constant]);
+            Value value;
+            if (IS_INSTANCE(receiver) &&
+                getCachedField(AS_INSTANCE(receiver), name, CACHE_AT(constant), &value)) {
+                push(value);
+                ip += 3;
+            } else {
+                // Let the unfused OP_GET_PROPERTY bind methods or report errors.
+                push(receiver);
+                ip++;
+            }
+            DISPATCH();
+        }
+        CASE(OP_BUILD_LIST):
+            buildList(READ_BYTE());
+            DISPATCH();
+        CASE(OP_BUILD_MAP): {
+            uint8_t entryCount = READ_BYTE();
+            if (!buildMap(entryCount, frame, ip)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
+            DISPATCH();
         }
+        CASE(OP_INDEX_SUBSCR):
+            if (!indexSubscript(frame, ip)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        CASE(OP_STORE_SUBSCR):
+            if (!storeSubscript(frame, ip)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
     }
 
+    // Unreachable.
+    return INTERPRET_RUNTIME_ERROR;
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef CACHE_AT
 #undef BINARY_FUNC_OP
 #undef BINARY_OP
+#undef QUICKEN
+#undef BINARY_NUM_OP
+#undef BINARY_BITWISE_OP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef ENTER_JIT
+#undef HOT_LOOP
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+#ifdef BASELINE_JIT
+// Runs the frame on top until it returns, in compiled code for as long as
+// tail calls keep moving it on to compiled functions. Calls it makes can move
+// the stacks, so the frame is looked up again each time.
+static bool runFrame() {
+    int index = vm.frameCount - 1;
+    while (vm.frames[index].closure->function->jit != NULL) {
+        JitResult result = jitRun(&vm.frames[index]);
+        if (result != JIT_TAIL_CALLED) return result != JIT_ERROR;
+    }
+
+    ptrdiff_t slots = vm.frames[index].slots - vm.stack;
+    vm.frames[index].callClosure = true;
+    if (run() != INTERPRET_OK) return false;
+    Value result = pop();
+    vm.stackTop = vm.stack + slots;
+    push(result);
+    return true;
+}
+
+// Runs the frame a call from compiled code pushed until it returns. The
+// compiled caller is still on the C stack, so unlike in run() the callee
+// can't just take over the loop.
+static bool runCallee(int callerCount) {
+    if (vm.frameCount == callerCount) return true; // Natives and classes without initializers.
+    if (cStackExhausted()) {
+        // The callee hasn't started, so the overflow is its caller's.
+        vm.frameCount--;
+        runtimeError(L"堆栈溢出。");
+        return false;
+    }
+    return runFrame();
+}
+
+// Finishes a callee compiled code entered directly, which left its compiled
+// code after a tail call.
+bool jitResume() {
+    return runFrame();
 }
 
+// OP_TAIL_CALL for compiled code. The frame only goes on in the same
+// compiled code when the callee wasn't a closure.
+JitResult jitTailCall(CallFrame* frame, uint8_t* ip) {
+    int argCount = *ip++;
+    frame->ip = ip;
+    Value callee = peek(argCount);
+    if (IS_CLOSURE(callee)) {
+        return tailCall(AS_CLOSURE(callee), argCount) ? JIT_TAIL_CALLED : JIT_ERROR;
+    }
+    int frameCount = vm.frameCount;
+    if (!callValue(callee, argCount)) return JIT_ERROR;
+    return runCallee(frameCount) ? JIT_RETURNED : JIT_ERROR;
+}
+
+// OP_CALL on a class for compiled code, which enters the initializer itself
+// when it is compiled and takes the arguments. Then this makes the instance
+// and returns the initializer. Otherwise it changes nothing and returns NULL,
+// leaving the call to jitExecute().
+ObjClosure* jitConstruct(ObjClass* klass, int argCount) {
+    if (!IS_CLOSURE(klass->initializer)) return NULL;
+    ObjClosure* initializer = AS_CLOSURE(klass->initializer);
+    if (initializer->function->jit == NULL || initializer->function->arity != argCount ||
+        vm.frameCount == vm.frameCapacity) {
+        return NULL;
+    }
+    vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass, false));
+    return initializer;
+}
+
+// Runs one instruction for compiled code, which inlines the common cases and
+// calls here for the rest. As in run(), ip points just past the opcode.
+bool jitExecute(CallFrame* frame, uint8_t* ip, OpCode instruction) {
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_STRING() \
+    AS_STRING(frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define CACHE_AT(constant) (&frame->closure->function->chunk.caches[constant])
+#define CHECK_NUMBERS(count) \
+    do { \
+      if (!IS_NUMBER(peek(0)) || ((count) == 2 && !IS_NUMBER(peek(1)))) { \
+        frame->ip = ip; \
+        runtimeError(L"操作数必须是数字。"); \
+        return false; \
+      } \
+    } while (false)
+#define BINARY_OP(valueType, op) \
+    do { \
+      CHECK_NUMBERS(2); \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(valueType(a op b)); \
+    } while (false)
+#define BINARY_BITWISE_OP(op) \
+    do { \
+      CHECK_NUMBERS(2); \
+      int32_t b = (int32_t)AS_NUMBER(pop()); \
+      int32_t a = (int32_t)AS_NUMBER(pop()); \
+      push(NUMBER_VAL(a op b)); \
+    } while (false)
+
+    switch (instruction) {
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                frame->ip = ip;
+                stringError(L"未定义的变量「%ls」。", AS_STRING(vm.globalNames.values[slot]));
+                return false;
+            }
+            if (instruction == OP_GET_GLOBAL) {
+                push(vm.globalValues.values[slot]);
+            } else {
+                vm.globalValues.values[slot] = peek(0);
+            }
+            return true;
+        }
+        case OP_SET_UPVALUE: {
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = peek(0);
+            writeBarrier(&upvalue->obj, peek(0));
+            return true;
+        }
+        case OP_GET_PROPERTY: {
+            uint8_t constant = READ_BYTE();
+            return getProperty(frame, ip, constant);
+        }
+        case OP_SET_PROPERTY: {
+            uint8_t constant = READ_BYTE();
+            return setProperty(frame, ip, constant);
+        }
+        case OP_GET_SUPER: {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(pop());
+            return bindMethod(superclass, name, frame, ip);
+        }
+        case OP_BUILD_LIST:
+            buildList(READ_BYTE());
+            return true;
+        case OP_BUILD_MAP: {
+            uint8_t entryCount = READ_BYTE();
+            return buildMap(entryCount, frame, ip);
+        }
+        case OP_INDEX_SUBSCR:
+            return indexSubscript(frame, ip);
+        case OP_STORE_SUBSCR:
+            return storeSubscript(frame, ip);
+        case OP_GREATER: BINARY_OP(BOOL_VAL, >); return true;
+        case OP_LESS: BINARY_OP(BOOL_VAL, <); return true;
+        case OP_ADD:
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                Value result = concatenateStrings(peek(1), peek(0));
+                pop();
+                pop();
+                push(result);
+                return true;
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                BINARY_OP(NUMBER_VAL, +);
+                return true;
+            }
+            frame->ip = ip;
+            runtimeError(L"操作数必须是两个数字或两个字符串。");
+            return false;
+        case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); return true;
+        case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); return true;
+        case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); return true;
+        case OP_MODULO: {
+            CHECK_NUMBERS(2);
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(NUMBER_VAL(fmod(a, b)));
+            return true;
+        }
+        case OP_BITWISE_AND: BINARY_BITWISE_OP(&); return true;
+        case OP_BITWISE_OR: BINARY_BITWISE_OP(|); return true;
+        case OP_BITWISE_XOR: BINARY_BITWISE_OP(^); return true;
+        case OP_BITWISE_LEFT_SHIFT: BINARY_BITWISE_OP(<<); return true;
+        case OP_BITWISE_RIGHT_SHIFT: BINARY_BITWISE_OP(>>); return true;
+        case OP_BITWISE_NOT:
+            CHECK_NUMBERS(1);
+            push(NUMBER_VAL(~(int32_t)AS_NUMBER(pop())));
+            return true;
+        case OP_INCREMENT:
+            CHECK_NUMBERS(1);
+            push(NUMBER_VAL(AS_NUMBER(pop()) + 1));
+            return true;
+        case OP_DECREMENT:
+            CHECK_NUMBERS(1);
+            push(NUMBER_VAL(AS_NUMBER(pop()) - 1));
+            return true;
+        case OP_NEGATE:
+            CHECK_NUMBERS(1);
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            return true;
+        case OP_CALL: {
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            int frameCount = vm.frameCount;
+            if (!callValue(peek(argCount), argCount)) return false;
+            return runCallee(frameCount);
+        }
+        case OP_INVOKE: {
+            uint8_t constant = READ_BYTE();
+            ObjString *method = AS_STRING(frame->closure->function->chunk.constants.values[constant]);
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            int frameCount = vm.frameCount;
+            if (!invoke(method, argCount, CACHE_AT(constant), frame, ip)) return false;
+            return runCallee(frameCount);
+        }
+        case OP_SUPER_INVOKE: {
+            uint8_t constant = READ_BYTE();
+            ObjString *method = AS_STRING(frame->closure->function->chunk.constants.values[constant]);
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            int frameCount = vm.frameCount;
+            if (!superInvoke(method, argCount, CACHE_AT(constant), frame, ip)) return false;
+            return runCallee(frameCount);
+        }
+        case OP_CLOSURE:
+            makeClosure(frame, ip);
+            return true;
+        case OP_CLOSE_UPVALUE:
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+            return true;
+        case OP_CLASS:
+            push(OBJ_VAL(newClass(READ_STRING())));
+            return true;
+        case OP_INHERIT:
+            return inherit(frame, ip);
+        case OP_METHOD:
+            defineMethod(READ_STRING());
+            return true;
+        default:
+            // Compiled code handles everything else itself.
+            frame->ip = ip;
+            runtimeError(L"未知操作码 %d。", instruction);
+            return false;
+    }
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_STRING
+#undef CACHE_AT
+#undef CHECK_NUMBERS
+#undef BINARY_OP
+#undef BINARY_BITWISE_OP
+}
+
+// OP_RETURN for compiled code, which leaves its frame right after.
+JitResult jitReturn(CallFrame* frame) {
+    Value result = pop();
+    closeUpvalues(frame->slots);
+    vm.frameCount--;
+
+    if (vm.frameCount == 0) {
+        pop();
+        return JIT_FINISHED;
+    } else if (frame->callClosure) {
+        push(result);
+        frame->callClosure = false;
+        return JIT_FINISHED;
+    }
+
+    vm.stackTop = frame->slots;
+    push(result);
+    return JIT_RETURNED;
+}
+#endif
+
 InterpretResult runClosure(ObjClosure* closure, Value* value, Value args[], int argCount) {
     for (int i = 0; i < argCount; i++) {
         push(args[i]);
     }
-    call(closure, argCount);
+    if (cStackExhausted()) {
+        runtimeError(L"堆栈溢出。");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    if (!call(closure, argCount)) return INTERPRET_RUNTIME_ERROR;
     vm.frames[vm.frameCount - 1].callClosure = true;
     InterpretResult result = run();
+    // A runtime error has already reset the stack.
+    if (result != INTERPRET_OK) return result;
     *value = pop();
     vm.stackTop -= argCount;
     return result;
@@ -1314,5 +2404,7 @@ InterpretResult interpret(const char* source) {
     push(OBJ_VAL(closure));
     call(closure, 0);
 
+    char base;
+    vm.cStackBase = &base;
     return run();
 }
\ No newline at end of file
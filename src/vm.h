@@ -6,12 +6,33 @@
 #define QI_VM_H
 
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start out with room for FRAMES_INITIAL frames of UINT8_COUNT
+// values each and double together as calls get deeper, up to FRAMES_MAX.
+#define FRAMES_INITIAL 64
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 16384
+#endif
+// How long, in microseconds, each step of a major collection aims to take.
+#ifndef GC_PAUSE_BUDGET
+#define GC_PAUSE_BUDGET 1000
+#endif
+// In builds with PARALLEL_MARK, major collections trace an old generation of
+// more than PARALLEL_MARK_THRESHOLD bytes with MARK_THREADS threads.
+#ifndef MARK_THREADS
+#define MARK_THREADS 4
+#endif
+#ifndef PARALLEL_MARK_THRESHOLD
+#define PARALLEL_MARK_THRESHOLD (4 * 1024 * 1024)
+#endif
+#define MAX_MARK_THREADS 64
+// How much C stack calls back into the VM from C, like a native running a
+// closure, can use between them.
+#define C_STACK_MAX (4 * 1024 * 1024)
 
 typedef struct {
     ObjClosure* closure;
@@ -21,23 +42,88 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
-    Table globals;
+    // Where the C stack was when interpret() started.
+    char* cStackBase;
+    // The compiler resolves each global name to a slot in globalValues.
+    // Slots whose definition has not run yet hold UNDEFINED_VAL.
+    Table globalSlots;
+    ValueArray globalNames;
+    ValueArray globalValues;
     Table strings;
+    Table stringMethods;
+    Table listMethods;
+    Table mapMethods;
     ObjString* initString;
     ObjUpvalue* openUpvalues;
 
+    // Bytes held by old objects and by the arrays of all objects.
     size_t bytesAllocated;
     size_t nextGC;
-    Obj* objects;
+
+    // Every block objects are allocated in, and the hole the allocator is
+    // bumping through. allocBlock and allocLine are where it looks for the
+    // next hole, and reset to the first block after each collection.
+    Block* blocks;
+    // Blocks of a large object each, which the allocator doesn't bump into,
+    // and up to a nursery's worth of empty ones kept for the next.
+    Block* largeBlocks;
+    Block* spareBlocks;
+    size_t spareBytes;
+    Block* allocBlock;
+    int allocLine;
+    char* allocCursor;
+    char* allocLimit;
+    // The young generation is every object in youngSpans plus the one
+    // allocCursor is extending, which starts at spanStart.
+    char* spanStart;
+    YoungSpan* youngSpans;
+    int youngSpanCount;
+    int youngSpanCapacity;
+    size_t youngBytes;
+    // Free cells for small arrays, by size class, and the slabs they were
+    // cut from.
+    PoolCell* pools[POOL_CLASSES];
+    Slab* slabs;
+    // Old objects that may point to young ones.
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+    // Set while a minor collection runs, so marking stops at old objects.
+    bool youngOnly;
+    // Major collections mark and sweep the old generation a step at a time
+    // between allocations, each taking about gcPauseBudget nanoseconds. A
+    // budget of 0 collects in one go.
+    GcPhase gcPhase;
+    uint64_t gcPauseBudget;
+    // The next block the sweep goes through. The allocator sweeps blocks it
+    // gets to first itself, and the counts say how many blocks were swept
+    // each way.
+    Block* sweepBlock;
+    size_t eagerSweeps;
+    size_t lazySweeps;
+    // The longest the VM has stopped for any collection or step, in
+    // nanoseconds.
+    uint64_t gcMaxPause;
+    // Threads, the main one included, that trace the heap in parallel.
+    int markThreads;
+
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
     bool markValue;
+
+#ifdef DEBUG_CACHE_STATS
+    size_t propertyCacheHits;
+    size_t propertyCacheMisses;
+    size_t invokeCacheHits;
+    size_t invokeCacheMisses;
+#endif
 } VM;
 
 typedef enum {
@@ -55,6 +141,7 @@ InterpretResult runClosure(ObjClosure* closure, Value* value, Value args[], int
 InterpretResult interpret(const char* source);
 void push(Value value);
 Value pop();
+int globalSlot(ObjString* name);
 void defineNativeInstance(wchar_t* name, ObjInstance* instance);
 void defineNative(const wchar_t* name, NativeFn function, int arity, ObjClass* klass);
 void defineProperty(const wchar_t* name, Value value, ObjInstance* instance);